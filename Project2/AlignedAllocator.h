@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+using namespace std;
+
+/**
+ * Allocator handing out memory aligned to Alignment bytes, so that tables
+ * start on a cache line.
+ */
+template<class T, size_t Alignment = 64>
+class AlignedAllocator
+{
+public:
+    typedef T value_type;
+    
+    template<class U>
+    struct rebind { typedef AlignedAllocator<U, Alignment> other; };
+    
+    AlignedAllocator() { }
+    
+    template<class U>
+    AlignedAllocator(const AlignedAllocator<U, Alignment>&) { }
+    
+    T* allocate(size_t n) {
+        void* ptr = nullptr;
+        if (posix_memalign(&ptr, Alignment, n * sizeof(T) > 0 ? n * sizeof(T) : Alignment) != 0)
+            throw bad_alloc();
+        return static_cast<T*>(ptr);
+    }
+    
+    void deallocate(T* ptr, size_t) {
+        free(ptr);
+    }
+    
+    template<class U>
+    bool operator==(const AlignedAllocator<U, Alignment>&) const { return true; }
+    
+    template<class U>
+    bool operator!=(const AlignedAllocator<U, Alignment>&) const { return false; }
+};
+
+template<class T>
+using aligned_vector = vector<T, AlignedAllocator<T>>;
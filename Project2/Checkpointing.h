@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cmath>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * Block length for a checkpointed dynamic program over length positions.
+ * Every block keeps a checkpoint of checkpointBytes, and the block being
+ * recomputed costs rowBytes per position. Returns the largest block length
+ * that fits in memoryBudget, or the one using the least memory if none
+ * does. A budget of 0 means no limit, i.e. a single block.
+ */
+inline size_t checkpoint_block_length(size_t length, size_t minBlock, size_t checkpointBytes,
+                                      size_t rowBytes, size_t memoryBudget)
+{
+    if (memoryBudget == 0 || length <= minBlock)
+        return max<size_t>(length, 1);
+    
+    auto memory = [=] (size_t block) {
+        return ((length + block - 1) / block) * checkpointBytes + block * rowBytes;
+    };
+    
+    if (memory(length) <= memoryBudget)
+        return length;
+    
+    // Memory is smallest around sqrt(length * checkpointBytes / rowBytes)
+    size_t lo = max(minBlock, (size_t) sqrt((double) length * checkpointBytes / max<size_t>(rowBytes, 1)));
+    lo = min(lo, length);
+    if (memory(lo) > memoryBudget)
+        return lo;
+    
+    size_t hi = length;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (memory(mid) <= memoryBudget)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
@@ -1,8 +1,12 @@
 #include <fstream>
 #include <vector>
 #include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
 
 #include "HMM.h"
+#include "MappedFile.h"
 
 using namespace std;
 
@@ -79,3 +83,172 @@ void HMM::toDot(ofstream &stream)
     
     stream << "}" << endl;
 }
+
+/*
+ * A binary model file is a header followed by a payload in native byte
+ * order, with every section padded to 8 bytes:
+ *
+ *   the symbols, by index
+ *   the length of every state name, then the names
+ *   the log-probs of pi, of A and of phi, row by row without padding
+ *   the incomming lists: numStates + 1 offsets, then the states and the
+ *   log-probs of all possible transitions
+ */
+
+static const char MODEL_MAGIC[8] = { 'H', 'M', 'M', 'B', 'I', 'N', '2', '\0' };
+static const uint64_t MODEL_VERSION = 1;
+
+struct ModelHeader
+{
+    char magic[8];
+    uint64_t version, states, symbols, transitions, payloadBytes;
+};
+
+template<class T>
+static void put(string& out, const T* values, size_t count)
+{
+    out.append(reinterpret_cast<const char*>(values), count * sizeof(T));
+}
+
+static void pad(string& out)
+{
+    out.resize((out.size() + 7) / 8 * 8, '\0');
+}
+
+void HMM::toBinary(ofstream& stream) const
+{
+    if (!logTransformed)
+        throw runtime_error("Model should be log-transformed!");
+    
+    const size_t K = states(), S = symbols();
+    string payload(S, '\0');
+    for (auto symbol : symbolMap)
+        payload[symbol.second] = symbol.first;
+    pad(payload);
+    
+    for (auto state : stateMap) {
+        const uint64_t length = state.second.size();
+        put(payload, &length, 1);
+    }
+    for (auto state : stateMap)
+        payload += state.second;
+    pad(payload);
+    
+    put(payload, pi.data(), K);
+    for (size_t i = 0; i < K; i++)
+        put(payload, A.row(i).data(), K);
+    for (size_t i = 0; i < K; i++)
+        put(payload, phi.row(i).data(), S);
+    
+    uint64_t transitions = 0;
+    for (size_t j = 0; j < K; j++) {
+        put(payload, &transitions, 1);
+        transitions += incommingStates(j).size();
+    }
+    put(payload, &transitions, 1);
+    for (size_t j = 0; j < K; j++) {
+        for (uint64_t i : incommingStates(j))
+            put(payload, &i, 1);
+    }
+    for (size_t j = 0; j < K; j++)
+        put(payload, incommingLogProbs(j).data(), incommingLogProbs(j).size());
+    
+    ModelHeader header;
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.states = K;
+    header.symbols = S;
+    header.transitions = transitions;
+    header.payloadBytes = payload.size();
+    
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(payload.data(), payload.size());
+    if (!stream)
+        throw runtime_error("Could not write model!");
+}
+
+unique_ptr<HMM> HMM::loadFromBinary(const string& path)
+{
+    MappedFile file(path);
+    
+    ModelHeader header;
+    if (file.size() < sizeof(header))
+        throw runtime_error("Not a binary model file: " + path);
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+        throw runtime_error("Not a binary model file: " + path);
+    if (header.version != MODEL_VERSION)
+        throw runtime_error("Unsupported model file version in " + path);
+    if (header.payloadBytes != file.size() - sizeof(header))
+        throw runtime_error("Truncated model file!");
+    
+    // Hands out the sections of the payload in order
+    const char* at = file.data() + sizeof(header);
+    const char* end = at + header.payloadBytes;
+    auto take = [&at, end] (size_t count, size_t size) {
+        if (count > size_t(end - at) / size || (count * size + 7) / 8 * 8 > size_t(end - at))
+            throw runtime_error("Truncated model file!");
+        const char* values = at;
+        at += (count * size + 7) / 8 * 8;
+        return values;
+    };
+    
+    const size_t K = header.states, S = header.symbols, T = header.transitions;
+    const char* symbolData = take(S, 1);
+    vector<char> symbols(symbolData, symbolData + S);
+    
+    const uint64_t* lengths = reinterpret_cast<const uint64_t*>(take(K, sizeof(uint64_t)));
+    size_t namesLength = 0;
+    for (size_t i = 0; i < K; i++)
+        namesLength += lengths[i];
+    const char* names = take(namesLength, 1);
+    vector<string> states;
+    for (size_t i = 0; i < K; i++) {
+        states.push_back(string(names, lengths[i]));
+        names += lengths[i];
+    }
+    
+    unique_ptr<HMM> model(new HMM(states, symbols));
+    
+    // The padding of the matrices holds log(0), as after logTransform()
+    model->A = Matrix<double>(K, K, ln(0));
+    model->phi = Matrix<double>(K, S, ln(0));
+    
+    memcpy(model->pi.data(), take(K, sizeof(double)), K * sizeof(double));
+    for (size_t i = 0; i < K; i++)
+        memcpy(model->A.row(i).data(), take(K, sizeof(double)), K * sizeof(double));
+    for (size_t i = 0; i < K; i++)
+        memcpy(model->phi.row(i).data(), take(S, sizeof(double)), S * sizeof(double));
+    
+    const uint64_t* offsets = reinterpret_cast<const uint64_t*>(take(K + 1, sizeof(uint64_t)));
+    const uint64_t* incomming = reinterpret_cast<const uint64_t*>(take(T, sizeof(uint64_t)));
+    const double* logProbs = reinterpret_cast<const double*>(take(T, sizeof(double)));
+    if (at != end || offsets[0] != 0 || offsets[K] != T)
+        throw runtime_error("Corrupt model file: " + path);
+    
+    // Decoding searches the incomming lists, so they must be exactly the
+    // possible transitions of A, in strictly increasing order
+    for (size_t j = 0; j < K; j++) {
+        if (offsets[j] > offsets[j + 1])
+            throw runtime_error("Corrupt model file: " + path);
+        
+        size_t possible = 0;
+        for (size_t i = 0; i < K; i++)
+            possible += model->A(i, j) != ln(0);
+        if (possible != offsets[j + 1] - offsets[j])
+            throw runtime_error("Corrupt model file: " + path);
+        
+        for (size_t t = offsets[j]; t < offsets[j + 1]; t++) {
+            if (incomming[t] >= K || (t > offsets[j] && incomming[t] <= incomming[t - 1])
+                || logProbs[t] != model->A(incomming[t], j))
+                throw runtime_error("Corrupt model file: " + path);
+        }
+    }
+    
+    model->transitions = SparseTransitions(Span<const uint64_t>(offsets, K + 1),
+                                           Span<const uint64_t>(incomming, T),
+                                           Span<const double>(logProbs, T));
+    model->logTransformed = true;
+    
+    return model;
+}
@@ -4,13 +4,18 @@
 #include <string>
 #include <cmath>
 #include <map>
+#include <limits>
+#include <memory>
+#include <fstream>
 
 #include "Matrix.h"
+#include "Span.h"
+#include "SparseTransitions.h"
 
 using namespace std;
 
 // Natural logarithm function
-auto ln = [] (double x) { return log(x); };
+static auto ln = [] (double x) { return log(x); };
 
 class HMM
 {
@@ -18,8 +23,7 @@ public:
     HMM(vector<string> states, vector<char> symbols)
     : A(Matrix<double>(states.size(), states.size(), 0.)),
     phi(Matrix<double>(states.size(), symbols.size(), 0.)),
-    pi(vector<double>(states.size(), 0.)),
-    incomming(states.size(), {})
+    pi(vector<double>(states.size(), 0.))
     {
         for (size_t i = 0; i < states.size(); i++)
             stateMap.insert(make_pair(i, states[i]));
@@ -41,12 +45,7 @@ public:
             pi[i] = ln(pi[i]);
         
         // Hack! Wrong place to do this!
-        for (size_t i = 0; i < states(); i++) {
-            for (size_t j = 0; j < states(); j++) {
-                if (transitionProb(i, j) > -numeric_limits<double>::infinity())
-                    incomming[j].push_back(i);
-            }
-        }
+        transitions = SparseTransitions(A, true);
         
         logTransformed = true;
     }
@@ -58,6 +57,13 @@ public:
         return phi(state, symbolMap.at(symbol));
     }
     
+    /**
+     * Index of a symbol into the columns of phi.
+     */
+    inline size_t symbolIndex(char symbol) const {
+        return symbolMap.at(symbol);
+    }
+    
     /**
      * The probability of going from state 'from' to 'to'.
      */
@@ -65,8 +71,17 @@ public:
         return A(from, to);
     }
     
-    vector<size_t> incommingStates(size_t state) const {
-        return incomming[state];
+    /**
+     * States with a possible transition into state, in increasing order, and
+     * the log-probs of those transitions at the same positions. Only valid
+     * once log-transformed.
+     */
+    Span<const size_t> incommingStates(size_t state) const {
+        return transitions.incommingStates(state);
+    }
+    
+    Span<const double> incommingLogProbs(size_t state) const {
+        return transitions.incommingLogProbs(state);
     }
     
     /**
@@ -84,13 +99,26 @@ public:
     
     static unique_ptr<HMM> loadFromStream(ifstream& stream);
     
+    /**
+     * Write the log-transformed model in the binary format read by
+     * loadFromBinary().
+     */
+    void toBinary(ofstream& stream) const;
+    
+    /**
+     * Load a model written by toBinary(). The file is mapped into memory and
+     * the probs are copied out of it as they are, so the model comes back
+     * log-transformed without parsing or taking a single log.
+     */
+    static unique_ptr<HMM> loadFromBinary(const string& path);
+    
     void toDot(ofstream& stream);
     
 private:
     map<char, size_t> symbolMap;
     map<size_t, string> stateMap;
     
-    vector<vector<size_t>> incomming;
+    SparseTransitions transitions;
     
     bool logTransformed = false;
 };
@@ -0,0 +1,43 @@
+#include <string>
+#include <stdexcept>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "MappedFile.h"
+
+using namespace std;
+
+MappedFile::MappedFile(const string& path, bool sequential) : begin(nullptr), length(0)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw runtime_error("Could not find " + path);
+    
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw runtime_error("Could not read " + path);
+    }
+    
+    // An empty file cannot be mapped, and has nothing to map anyway
+    length = info.st_size;
+    if (length > 0) {
+        void* ptr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close(fd);
+            throw runtime_error("Could not map " + path);
+        }
+        madvise(ptr, length, sequential ? MADV_SEQUENTIAL : MADV_RANDOM);
+        begin = static_cast<const char*>(ptr);
+    }
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (begin != nullptr)
+        munmap(const_cast<char*>(begin), length);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+
+using namespace std;
+
+/**
+ * A file mapped read-only into memory for the lifetime of the object. The
+ * kernel is told to read ahead unless it will be accessed at random.
+ */
+class MappedFile
+{
+public:
+    explicit MappedFile(const string& path, bool sequential = true);
+    ~MappedFile();
+    
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    
+    const char* data() const { return begin; }
+    size_t size() const { return length; }
+
+private:
+    const char* begin;
+    size_t length;
+};
@@ -1,32 +1,116 @@
 #pragma once
 
 #include <vector>
+#include <utility>
+#include <algorithm>
+#include <type_traits>
+#include <cassert>
+
+#include "AlignedAllocator.h"
+#include "Span.h"
 
 using namespace std;
 
+/**
+ * Rows of floating point matrices are padded to a multiple of this many
+ * bytes, the width of an AVX register, so that every row starts aligned
+ * and vector kernels can run over whole rows without a scalar tail.
+ */
+const size_t MATRIX_ROW_BYTES = 32;
+
+/**
+ * Entries stored per row of a matrix of T with the given columns. Integer
+ * matrices, such as backpointer tables, are only ever indexed and can be
+ * large, so their rows are not padded.
+ */
+template<class T>
+inline size_t matrix_row_width(size_t columns)
+{
+    if (!is_floating_point<T>::value)
+        return columns;
+    
+    const size_t lanes = MATRIX_ROW_BYTES / sizeof(T);
+    return (columns + lanes - 1) / lanes * lanes;
+}
+
+/**
+ * Dense n x m matrix stored row by row in 64-byte aligned memory, see
+ * matrix_row_width() for the padding of the rows. The padding holds the
+ * value the matrix was made with.
+ */
 template<class T>
 class Matrix
 {
 public:
-    Matrix(size_t n, size_t m, const T& value) : n(n), m(m), elements(vector<T>(n * m, value))
+    Matrix() : n(0), m(0), stride(0)
+    { }
+    
+    Matrix(size_t n, size_t m, const T& value)
+        : n(n), m(m), stride(matrix_row_width<T>(m)), elements(n * stride, value)
     { }
     
+    size_t rows() const { return n; }
+    size_t columns() const { return m; }
+    
+    /**
+     * Entries from the start of one row to the next.
+     */
+    size_t width() const { return stride; }
+    
     inline T operator()(size_t row, size_t column) const {
         // assert(row < n && column < m);
-        return elements[m * row + column];
+        return elements[stride * row + column];
     }
     
     inline T& operator()(size_t row, size_t column) {
         // assert(row < n && column < m);
-        return elements[m * row + column];
+        return elements[stride * row + column];
     }
     
-    void map(function<T(T)> op) {
-        for (size_t i = 0; i < n * m; i++)
-            elements[i] = op(elements[i]);
+    /**
+     * The m cells of a row. They start on a MATRIX_ROW_BYTES boundary.
+     */
+    inline Span<T> row(size_t i) {
+        return Span<T>(&elements[stride * i], m);
     }
     
+    inline Span<const T> row(size_t i) const {
+        return Span<const T>(&elements[stride * i], m);
+    }
+    
+    inline StridedSpan<T> column(size_t j) {
+        return StridedSpan<T>(&elements[j], n, stride);
+    }
+    
+    inline StridedSpan<const T> column(size_t j) const {
+        return StridedSpan<const T>(&elements[j], n, stride);
+    }
+    
+    /**
+     * Replace every entry x, padding included, by op(x).
+     */
+    template<class Op>
+    void map(Op op) {
+        for (T& element : elements)
+            element = op(element);
+    }
+    
+    /**
+     * A matrix of the same shape holding op(x) for every cell x. Like map(),
+     * its padding holds op of the padding, or op(T()) without one.
+     */
+    template<class Op>
+    auto transform(Op op) const -> Matrix<typename decay<decltype(op(declval<T>()))>::type> {
+        typedef typename decay<decltype(op(declval<T>()))>::type U;
+        Matrix<U> result(n, m, op(n > 0 && stride > m ? elements[m] : T()));
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < m; j++)
+                result(i, j) = op(elements[stride * i + j]);
+        }
+        return result;
+    }
+
 private:
-    const size_t n, m;
-    vector<T> elements;
+    size_t n, m, stride;
+    aligned_vector<T> elements;
 };
@@ -0,0 +1,126 @@
+#include <limits>
+#include <cstdint>
+
+#include "MaxPlus.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MAX_PLUS_X86
+#endif
+
+using namespace std;
+
+/*
+ * Every kernel keeps the running maximum of each lane and the index it was
+ * first reached at, then picks the largest lane, breaking ties by index.
+ * That is the first maximum along j, as in a plain loop with strict >.
+ */
+
+static double max_plus_scalar(const double* scores, const double* weights, size_t n, size_t& argmax)
+{
+    double best = -numeric_limits<double>::infinity();
+    argmax = n;
+    for (size_t j = 0; j < n; j++) {
+        const double candidate = scores[j] + weights[j];
+        if (candidate > best) {
+            best = candidate;
+            argmax = j;
+        }
+    }
+    return best;
+}
+
+static double reduce_lanes(const double* lanes, const int64_t* indices, size_t width, size_t n, size_t& argmax)
+{
+    double best = -numeric_limits<double>::infinity();
+    argmax = n;
+    for (size_t k = 0; k < width; k++) {
+        if (lanes[k] > best || (lanes[k] == best && lanes[k] > -numeric_limits<double>::infinity()
+                                && size_t(indices[k]) < argmax)) {
+            best = lanes[k];
+            argmax = indices[k];
+        }
+    }
+    return best;
+}
+
+#ifdef MAX_PLUS_X86
+__attribute__((target("sse2")))
+static double max_plus_sse2(const double* scores, const double* weights, size_t n, size_t& argmax)
+{
+    __m128d best = _mm_set1_pd(-numeric_limits<double>::infinity());
+    __m128i bestIndex = _mm_setzero_si128();
+    __m128i index = _mm_set_epi64x(1, 0);
+    const __m128i step = _mm_set1_epi64x(2);
+    
+    for (size_t j = 0; j < n; j += 2) {
+        const __m128d candidate = _mm_add_pd(_mm_load_pd(scores + j), _mm_load_pd(weights + j));
+        const __m128d greater = _mm_cmpgt_pd(candidate, best);
+        const __m128i mask = _mm_castpd_si128(greater);
+        best = _mm_or_pd(_mm_and_pd(greater, candidate), _mm_andnot_pd(greater, best));
+        bestIndex = _mm_or_si128(_mm_and_si128(mask, index), _mm_andnot_si128(mask, bestIndex));
+        index = _mm_add_epi64(index, step);
+    }
+    
+    alignas(16) double lanes[2];
+    alignas(16) int64_t indices[2];
+    _mm_store_pd(lanes, best);
+    _mm_store_si128((__m128i*) indices, bestIndex);
+    return reduce_lanes(lanes, indices, 2, n, argmax);
+}
+
+__attribute__((target("avx2")))
+static double max_plus_avx2(const double* scores, const double* weights, size_t n, size_t& argmax)
+{
+    __m256d best = _mm256_set1_pd(-numeric_limits<double>::infinity());
+    __m256i bestIndex = _mm256_setzero_si256();
+    __m256i index = _mm256_set_epi64x(3, 2, 1, 0);
+    const __m256i step = _mm256_set1_epi64x(4);
+    
+    for (size_t j = 0; j < n; j += 4) {
+        const __m256d candidate = _mm256_add_pd(_mm256_load_pd(scores + j), _mm256_load_pd(weights + j));
+        const __m256d greater = _mm256_cmp_pd(candidate, best, _CMP_GT_OQ);
+        best = _mm256_blendv_pd(best, candidate, greater);
+        bestIndex = _mm256_blendv_epi8(bestIndex, index, _mm256_castpd_si256(greater));
+        index = _mm256_add_epi64(index, step);
+    }
+    
+    alignas(32) double lanes[4];
+    alignas(32) int64_t indices[4];
+    _mm256_store_pd(lanes, best);
+    _mm256_store_si256((__m256i*) indices, bestIndex);
+    return reduce_lanes(lanes, indices, 4, n, argmax);
+}
+#endif
+
+typedef double (*MaxPlusKernel)(const double*, const double*, size_t, size_t&);
+
+struct MaxPlusDispatch
+{
+    MaxPlusKernel kernel;
+    const char* name;
+};
+
+static MaxPlusDispatch select_max_plus()
+{
+#ifdef MAX_PLUS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return { max_plus_avx2, "avx2" };
+    if (__builtin_cpu_supports("sse2"))
+        return { max_plus_sse2, "sse2" };
+#endif
+    return { max_plus_scalar, "scalar" };
+}
+
+static const MaxPlusDispatch dispatch = select_max_plus();
+
+double max_plus(const double* scores, const double* weights, size_t n, size_t& argmax)
+{
+    return dispatch.kernel(scores, weights, n, argmax);
+}
+
+const char* max_plus_kernel()
+{
+    return dispatch.name;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstddef>
+
+using namespace std;
+
+/**
+ * A run of count values owned elsewhere, e.g. a row of a Matrix. Cheap to
+ * copy, and only valid as long as the values are.
+ */
+template<class T>
+class Span
+{
+public:
+    Span() : first(nullptr), count(0)
+    { }
+    
+    Span(T* first, size_t count) : first(first), count(count)
+    { }
+    
+    inline T* begin() const { return first; }
+    inline T* end() const { return first + count; }
+    inline T* data() const { return first; }
+    
+    inline size_t size() const { return count; }
+    inline bool empty() const { return count == 0; }
+    
+    inline T& operator[](size_t i) const {
+        return first[i];
+    }
+
+private:
+    T* first;
+    size_t count;
+};
+
+/**
+ * Every stride-th value of a run owned elsewhere, e.g. a column of a Matrix.
+ */
+template<class T>
+class StridedSpan
+{
+public:
+    StridedSpan(T* first, size_t count, size_t stride) : first(first), count(count), stride(stride)
+    { }
+    
+    inline size_t size() const { return count; }
+    
+    inline T& operator[](size_t i) const {
+        return first[i * stride];
+    }
+
+private:
+    T* first;
+    size_t count, stride;
+};
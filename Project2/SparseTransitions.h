@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <cstdint>
+
+#include "Matrix.h"
+#include "Span.h"
+#include "AlignedAllocator.h"
+
+using namespace std;
+
+/**
+ * The possible transitions of a model in compressed sparse row layout. The
+ * states every state can be entered from, and left to, are kept in
+ * increasing order in one contiguous array, with the probs and log-probs of
+ * those transitions at the same positions of arrays of their own. Kernels
+ * thus stream (state, weight) pairs without going back to the transition
+ * matrix.
+ */
+class SparseTransitions
+{
+public:
+    SparseTransitions()
+    { }
+    
+    /**
+     * The transitions of A, which holds log-probs if logSpace. A transition
+     * is possible if its prob is above 0.
+     */
+    SparseTransitions(const Matrix<double>& A, bool logSpace) {
+        auto add = [&A, logSpace] (Lists& lists, size_t from, size_t to, size_t state) {
+            const double value = A(from, to);
+            if (logSpace ? value == -numeric_limits<double>::infinity() : !(value > 0))
+                return;
+            lists.states.push_back(state);
+            lists.probs.push_back(logSpace ? exp(value) : value);
+            lists.logProbs.push_back(logSpace ? value : log(value));
+        };
+        
+        for (size_t j = 0; j < A.rows(); j++) {
+            into.offsets.push_back(into.states.size());
+            for (size_t i = 0; i < A.rows(); i++)
+                add(into, i, j, i);
+        }
+        into.offsets.push_back(into.states.size());
+        
+        for (size_t i = 0; i < A.rows(); i++) {
+            outOf.offsets.push_back(outOf.states.size());
+            for (size_t j = 0; j < A.rows(); j++)
+                add(outOf, i, j, j);
+        }
+        outOf.offsets.push_back(outOf.states.size());
+    }
+    
+    /**
+     * The transitions with the given log-probs, listed by the state they
+     * enter: the states entering state j are states[offsets[j]] up to
+     * states[offsets[j + 1]], in increasing order.
+     */
+    SparseTransitions(Span<const uint64_t> offsets, Span<const uint64_t> states, Span<const double> logProbs) {
+        const size_t numStates = offsets.size() - 1;
+        into.offsets.assign(offsets.begin(), offsets.end());
+        into.states.assign(states.begin(), states.end());
+        into.logProbs.assign(logProbs.begin(), logProbs.end());
+        for (auto value : into.logProbs)
+            into.probs.push_back(exp(value));
+        
+        // Transpose by counting, going through the target states in order
+        // keeps every outgoing list sorted
+        outOf.offsets.assign(numStates + 1, 0);
+        for (auto i : into.states)
+            outOf.offsets[i + 1]++;
+        for (size_t i = 0; i < numStates; i++)
+            outOf.offsets[i + 1] += outOf.offsets[i];
+        
+        vector<size_t> next(outOf.offsets.begin(), outOf.offsets.end() - 1);
+        outOf.states.resize(size());
+        outOf.probs.resize(size());
+        outOf.logProbs.resize(size());
+        for (size_t j = 0; j < numStates; j++) {
+            for (size_t t = into.offsets[j]; t < into.offsets[j + 1]; t++) {
+                const size_t at = next[into.states[t]]++;
+                outOf.states[at] = j;
+                outOf.probs[at] = into.probs[t];
+                outOf.logProbs[at] = into.logProbs[t];
+            }
+        }
+    }
+    
+    /**
+     * Number of possible transitions.
+     */
+    size_t size() const { return into.states.size(); }
+    
+    inline Span<const size_t> incommingStates(size_t state) const { return into.slice(into.states, state); }
+    inline Span<const double> incommingProbs(size_t state) const { return into.slice(into.probs, state); }
+    inline Span<const double> incommingLogProbs(size_t state) const { return into.slice(into.logProbs, state); }
+    
+    inline Span<const size_t> outgoingStates(size_t state) const { return outOf.slice(outOf.states, state); }
+    inline Span<const double> outgoingProbs(size_t state) const { return outOf.slice(outOf.probs, state); }
+    inline Span<const double> outgoingLogProbs(size_t state) const { return outOf.slice(outOf.logProbs, state); }
+
+private:
+    struct Lists
+    {
+        // The list of state is at [offsets[state], offsets[state + 1])
+        vector<size_t> offsets, states;
+        aligned_vector<double> probs, logProbs;
+        
+        template<class T, class Allocator>
+        inline Span<const T> slice(const vector<T, Allocator>& values, size_t state) const {
+            return Span<const T>(values.data() + offsets[state], offsets[state + 1] - offsets[state]);
+        }
+    };
+    
+    Lists into, outOf;
+};
@@ -7,4 +7,9 @@
 
 using namespace std;
 
-pair<double,vector<size_t>> viterbi(string observation, const HMM& model);
+/**
+ * Most likely state path for observation. With a memoryBudget in bytes the
+ * backpointer table is checkpointed to fit in it. A budget of 0 keeps the
+ * full table.
+ */
+pair<double,vector<size_t>> viterbi(string observation, const HMM& model, size_t memoryBudget = 0);
@@ -0,0 +1,278 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+#include <algorithm>
+
+#include "Matrix.h"
+#include "Span.h"
+#include "Checkpointing.h"
+#include "AlignedAllocator.h"
+#include "MaxPlus.h"
+
+using namespace std;
+
+/*
+ * Viterbi decoding shared by the decoders. Scores are kept in a ring of the
+ * last maxArity + 1 rows only, and the path is recovered from a table of
+ * backpointers. A backpointer is the position of the chosen predecessor in
+ * incommingStates(i), so a cell takes a single byte unless some state has
+ * 255 or more incomming states.
+ *
+ * Model must provide numStates(), stateArity(i), logStartProb(i), and the
+ * spans incommingStates(i) and incommingLogProbs(i) of the transitions into
+ * state i. Emissions must provide
+ * advance(), seek(l) and logProb(i), the log-prob that state i emits the
+ * symbols ending at the current position, starting at position 0.
+ *
+ * Given a memory budget the backpointers are only kept for one block at a
+ * time: the forward pass stores the score ring at the start of every block,
+ * and the backtrack recomputes each block it passes through from there.
+ *
+ * When a good share of all transitions is possible, the max over
+ * predecessors instead runs over dense log-transition columns with the
+ * vectorized max_plus(). The lists of incomming states must then be sorted.
+ */
+
+template<class Model>
+size_t viterbi_max_arity(const Model& model)
+{
+    size_t maxArity = 1;
+    for (size_t i = 0; i < model.numStates(); i++)
+        maxArity = max(maxArity, model.stateArity(i));
+    return maxArity;
+}
+
+/**
+ * The log-transition probs into every state as the rows of a matrix, with
+ * -inf for the transitions that are not possible and in the padding. Only
+ * built if at least a quarter of the entries are possible.
+ */
+class DenseTransitions
+{
+public:
+    template<class Model>
+    explicit DenseTransitions(const Model& model) : stride(max_plus_padded(model.numStates()))
+    {
+        static_assert(MATRIX_ROW_BYTES % (MAX_PLUS_WIDTH * sizeof(double)) == 0,
+                      "Matrix rows should be padded for max_plus()!");
+        
+        size_t transitions = 0;
+        for (size_t i = 0; i < model.numStates(); i++)
+            transitions += model.incommingStates(i).size();
+        
+        dense = 4 * transitions >= model.numStates() * stride;
+        if (!dense)
+            return;
+        
+        columns = Matrix<double>(model.numStates(), model.numStates(), -numeric_limits<double>::infinity());
+        for (size_t i = 0; i < model.numStates(); i++) {
+            Span<const size_t> incomming = model.incommingStates(i);
+            Span<const double> logProbs = model.incommingLogProbs(i);
+            for (size_t j = 0; j < incomming.size(); j++)
+                columns(i, incomming[j]) = logProbs[j];
+        }
+    }
+    
+    bool enabled() const { return dense; }
+    size_t width() const { return stride; }
+    
+    inline const double* column(size_t state) const {
+        return columns.row(state).data();
+    }
+
+private:
+    size_t stride;
+    bool dense;
+    Matrix<double> columns;
+};
+
+/**
+ * Fill the scores of positions [from, to) into the ring, with emissions
+ * positioned at from - 1. Backpointers of position l are written to row
+ * l - offset of backpointers, unless it is null. Uses the dense kernel if
+ * given enabled dense transitions.
+ */
+template<class Index, class Model, class Emissions>
+void viterbi_columns(const Model& model, Emissions& emissions, Matrix<double>& scores, size_t rows,
+                     size_t from, size_t to, Matrix<Index>* backpointers, size_t offset,
+                     const DenseTransitions* dense = nullptr)
+{
+    const size_t K = model.numStates();
+    const Index NONE = numeric_limits<Index>::max();
+    const double NEG_INF = -numeric_limits<double>::infinity();
+    
+    // Padded copies of the rows l - d read by the dense kernel
+    const size_t stride = dense != nullptr ? dense->width() : 0;
+    Matrix<double> previous(dense != nullptr ? rows : 0, K, NEG_INF);
+    
+    for (size_t l = from; l < to; l++) {
+        emissions.advance();
+        const size_t row = l % rows;
+        
+        for (size_t d = 1; d < rows && d <= l && dense != nullptr; d++) {
+            for (size_t i = 0; i < K; i++)
+                previous(d, i) = scores((l - d) % rows, i);
+        }
+        
+        for (size_t i = 0; i < K; i++) {
+            const size_t d = model.stateArity(i);
+            
+            // Find where we should come from
+            double best = NEG_INF;
+            Index bestIndex = NONE;
+            if (l >= d && dense != nullptr) {
+                size_t j;
+                best = max_plus(previous.row(d).data(), dense->column(i), stride, j);
+                if (j < stride) {
+                    Span<const size_t> incomming = model.incommingStates(i);
+                    bestIndex = Index(lower_bound(incomming.begin(), incomming.end(), j) - incomming.begin());
+                }
+            } else if (l >= d) {
+                const size_t prevRow = (l - d) % rows;
+                Span<const size_t> incomming = model.incommingStates(i);
+                Span<const double> logProbs = model.incommingLogProbs(i);
+                for (size_t j = 0; j < incomming.size(); j++) {
+                    double candidate = scores(prevRow, incomming[j]) + logProbs[j];
+                    if (candidate > best) {
+                        best = candidate;
+                        bestIndex = Index(j);
+                    }
+                }
+            }
+            
+            if (backpointers != nullptr)
+                (*backpointers)(l - offset, i) = bestIndex;
+            scores(row, i) = bestIndex == NONE ? NEG_INF : best + emissions.logProb(i);
+        }
+    }
+}
+
+/**
+ * Follow the backpointers from state at the last position. backpointer(pos, state)
+ * gives the stored backpointer of a cell.
+ */
+template<class Index, class Model, class Backpointer>
+vector<size_t> viterbi_backtrack(const Model& model, size_t length, size_t state, Backpointer backpointer)
+{
+    const Index NONE = numeric_limits<Index>::max();
+    
+    vector<size_t> stateTrace;
+    size_t pos = length - 1;
+    stateTrace.push_back(state);
+    while (pos > 0) {
+        Index index = backpointer(pos, state);
+        if (index == NONE)
+            break;
+        
+        size_t prev = model.incommingStates(state)[index];
+        pos -= model.stateArity(state);
+        state = prev;
+        stateTrace.push_back(state);
+    }
+    
+    return vector<size_t>(stateTrace.rbegin(), stateTrace.rend());
+}
+
+template<class Index, class Model, class Emissions>
+pair<double,vector<size_t>> viterbi_decode_with(const Model& model, Emissions& emissions, size_t length,
+                                                size_t memoryBudget)
+{
+    const size_t K = model.numStates();
+    const Index NONE = numeric_limits<Index>::max();
+    const double NEG_INF = -numeric_limits<double>::infinity();
+    
+    if (length == 0)
+        return make_pair(NEG_INF, vector<size_t>());
+    
+    const size_t maxArity = viterbi_max_arity(model);
+    const size_t rows = maxArity + 1;
+    
+    // Blocks cover positions 1 to length - 1
+    const size_t blockLength = checkpoint_block_length(length - 1, maxArity, rows * K * sizeof(double),
+                                                       K * sizeof(Index), memoryBudget);
+    
+    const DenseTransitions transitions(model);
+    const DenseTransitions* dense = transitions.enabled() ? &transitions : nullptr;
+    
+    Matrix<double> scores(rows, K, NEG_INF);
+    for (size_t i = 0; i < K; i++)
+        scores(0, i) = model.logStartProb(i) + emissions.logProb(i);
+    
+    auto finalState = [&] () {
+        const size_t last = (length - 1) % rows;
+        pair<int, double> best = make_pair(-1, NEG_INF);
+        for (size_t i = 0; i < K; i++) {
+            if (scores(last, i) > best.second)
+                best = make_pair(i, scores(last, i));
+        }
+        return best;
+    };
+    
+    if (blockLength + 1 >= length) {
+        Matrix<Index> backpointers(length, K, NONE);
+        viterbi_columns(model, emissions, scores, rows, 1, length, &backpointers, 0, dense);
+        
+        pair<int, double> best = finalState();
+        if (best.first == -1)
+            return make_pair(NEG_INF, vector<size_t>());
+        
+        return make_pair(best.second, viterbi_backtrack<Index>(model, length, best.first,
+                                                               [&backpointers] (size_t pos, size_t state) {
+            return backpointers(pos, state);
+        }));
+    }
+    
+    // Checkpointed: keep the score ring at the start of every block
+    vector<Matrix<double>> checkpoints;
+    for (size_t start = 1; start < length; start += blockLength) {
+        checkpoints.push_back(scores);
+        viterbi_columns<Index>(model, emissions, scores, rows, start, min(start + blockLength, length), nullptr, 0,
+                                   dense);
+    }
+    
+    pair<int, double> best = finalState();
+    if (best.first == -1)
+        return make_pair(NEG_INF, vector<size_t>());
+    
+    Matrix<Index> block(blockLength, K, NONE);
+    size_t loaded = checkpoints.size();
+    auto backpointer = [&] (size_t pos, size_t state) {
+        const size_t b = (pos - 1) / blockLength;
+        const size_t start = 1 + b * blockLength;
+        if (b != loaded) {
+            for (size_t r = 0; r < rows; r++) {
+                for (size_t i = 0; i < K; i++)
+                    scores(r, i) = checkpoints[b](r, i);
+            }
+            emissions.seek(start - 1);
+            viterbi_columns(model, emissions, scores, rows, start, min(start + blockLength, length), &block, start,
+                            dense);
+            loaded = b;
+        }
+        return block(pos - start, state);
+    };
+    
+    return make_pair(best.second, viterbi_backtrack<Index>(model, length, best.first, backpointer));
+}
+
+/**
+ * Decode length symbols, picking the smallest backpointer type that can
+ * index every list of incomming states. With a memoryBudget in bytes
+ * other than 0 the tables are checkpointed to fit in it if possible.
+ */
+template<class Model, class Emissions>
+pair<double,vector<size_t>> viterbi_decode(const Model& model, Emissions& emissions, size_t length,
+                                           size_t memoryBudget = 0)
+{
+    size_t maxIncomming = 0;
+    for (size_t i = 0; i < model.numStates(); i++)
+        maxIncomming = max(maxIncomming, model.incommingStates(i).size());
+    
+    if (maxIncomming < numeric_limits<uint8_t>::max())
+        return viterbi_decode_with<uint8_t>(model, emissions, length, memoryBudget);
+    if (maxIncomming < numeric_limits<uint16_t>::max())
+        return viterbi_decode_with<uint16_t>(model, emissions, length, memoryBudget);
+    return viterbi_decode_with<uint32_t>(model, emissions, length, memoryBudget);
+}
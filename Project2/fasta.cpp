@@ -1,26 +1,65 @@
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <cstring>
+
 #include "fasta.h"
+#include "MappedFile.h"
 
-vector<pair<string,string>> read_fasta_from_stream(ifstream& stream)
+using namespace std;
+
+string FastaRecord::sequence() const
 {
-    vector<pair<string,string>> seqs;
-    string seq, line, name;
-    while (getline(stream, line)) {
-        if (!line.empty() && line[0] == '>') {
-            if (!seq.empty()) {
-                seqs.push_back(make_pair(name, seq));
-                seq = "";
-            }
-            name = line.substr(1);
-        } else if (!line.empty() && line[0] == ';') {
-            // Ignore the line...
-        } else {
-            for (unsigned int i = 0; i < line.length(); i++) {
-                if (line[i] != ' ')
-                    seq += line[i];
-            }
+    string seq;
+    seq.reserve(bodyLength);
+    forEachRun([&seq] (const char* symbols, size_t n) { seq.append(symbols, n); });
+    return seq;
+}
+
+vector<FastaRecord> fasta_records(const char* data, size_t size)
+{
+    vector<FastaRecord> records;
+    const char* end = data + size;
+    const char* header = data;
+    size_t headerLength = 0;
+    const char* body = data;
+    bool hasSymbols = false;
+    
+    for (const char* p = data; p < end;) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        
+        if (*p == '>') {
+            if (hasSymbols)
+                records.push_back(FastaRecord(header, headerLength, body, p - body));
+            
+            header = p + 1;
+            headerLength = lineEnd - header;
+            if (headerLength > 0 && header[headerLength - 1] == '\r')
+                headerLength--;
+            body = lineEnd < end ? lineEnd + 1 : end;
+            hasSymbols = false;
+        } else if (*p != ';') {
+            for (const char* q = p; q < lineEnd && !hasSymbols; q++)
+                hasSymbols = !FastaRecord::isBlank(*q);
         }
+        p = lineEnd + 1;
     }
-    seqs.push_back(make_pair(name, seq));
+    records.push_back(FastaRecord(header, headerLength, body, end - body));
+    
+    return records;
+}
+
+vector<pair<string,string>> read_fasta_from_stream(ifstream& stream)
+{
+    const string data((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    
+    vector<pair<string,string>> seqs;
+    for (auto& record : fasta_records(data.data(), data.size()))
+        seqs.push_back(make_pair(record.name(), record.sequence()));
     return seqs;
 }
 
@@ -28,15 +67,9 @@ vector<string> read_seqs_from_files(vector<string> files)
 {
     vector<string> seqs;
     for (string file : files) {
-        ifstream stream(file);
-        if (!stream.is_open())
-            throw runtime_error("Could not find " + file);
-        
-        auto seqsInFile = read_fasta_from_stream(stream);
-        for (auto seqdesc : seqsInFile)
-            seqs.push_back(seqdesc.second);
-        
-        stream.close();
+        MappedFile mapped(file);
+        for (auto& record : fasta_records(mapped.data(), mapped.size()))
+            seqs.push_back(record.sequence());
     }
     return seqs;
 }
@@ -4,9 +4,76 @@
 #include <vector>
 #include <fstream>
 #include <string>
+#include <cstring>
 
 using namespace std;
 
+/**
+ * A record of a FASTA file held in memory, pointing into the file data.
+ * The sequence may span several lines and is read with forEachRun().
+ */
+class FastaRecord
+{
+public:
+    FastaRecord(const char* header, size_t headerLength, const char* body, size_t bodyLength)
+        : header(header), headerLength(headerLength), body(body), bodyLength(bodyLength)
+    { }
+    
+    string name() const { return string(header, headerLength); }
+    
+    /**
+     * Bytes the sequence spans in the file, an upper bound on its length.
+     */
+    size_t rawLength() const { return bodyLength; }
+    
+    /**
+     * Call visit(symbols, n) for every run of symbols of the sequence in
+     * order, skipping line breaks, blanks and comment lines.
+     */
+    template<class Visit>
+    void forEachRun(Visit visit) const {
+        const char* p = body;
+        const char* end = body + bodyLength;
+        while (p < end) {
+            const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (lineEnd == nullptr)
+                lineEnd = end;
+            
+            if (*p != ';') {
+                const char* run = p;
+                for (const char* q = p; q < lineEnd; q++) {
+                    if (isBlank(*q)) {
+                        if (q > run)
+                            visit(run, size_t(q - run));
+                        run = q + 1;
+                    }
+                }
+                if (lineEnd > run)
+                    visit(run, size_t(lineEnd - run));
+            }
+            p = lineEnd + 1;
+        }
+    }
+    
+    string sequence() const;
+    
+    static inline bool isBlank(char c) {
+        return c == ' ' || c == '\r' || c == '\t';
+    }
+
+private:
+    const char* header;
+    size_t headerLength;
+    const char* body;
+    size_t bodyLength;
+};
+
+/**
+ * The records of FASTA data in memory. Like read_fasta_from_stream(), a
+ * record without symbols is dropped unless it is the last one.
+ */
+vector<FastaRecord> fasta_records(const char* data, size_t size);
+
 vector<pair<string,string>> read_fasta_from_stream(ifstream& stream);
 vector<string> read_seqs_from_files(vector<string> files);
 
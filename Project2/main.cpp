@@ -88,6 +88,12 @@ int main(int argc, const char * argv[])
     model->toDot(out);
     out.close();
     
+    cout << "Writing model to binary file..." << endl;
+    
+    ofstream binary("model.bin", ofstream::binary);
+    model->toBinary(binary);
+    binary.close();
+    
     cout << "Running Viterbi..." << endl;
     
     double probability;
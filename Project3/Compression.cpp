@@ -0,0 +1,204 @@
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+
+#include <zlib.h>
+
+#include "Compression.h"
+
+using namespace std;
+
+static const unsigned char GZIP_ID1 = 0x1f, GZIP_ID2 = 0x8b, GZIP_DEFLATE = 8, GZIP_FEXTRA = 4;
+static const size_t GZIP_HEADER = 12, GZIP_TRAILER = 8;
+
+// Most input zlib takes in a single call
+static const size_t INFLATE_INPUT = size_t(1) << 30;
+
+static inline uint32_t read_le(const unsigned char* p, size_t bytes)
+{
+    uint32_t value = 0;
+    for (size_t i = 0; i < bytes; i++)
+        value |= uint32_t(p[i]) << (8 * i);
+    return value;
+}
+
+static bool is_gzip(const unsigned char* p, size_t size)
+{
+    return size >= 3 && p[0] == GZIP_ID1 && p[1] == GZIP_ID2 && p[2] == GZIP_DEFLATE;
+}
+
+/**
+ * Size of the BGZF block at p, or 0 if it is not one.
+ */
+static size_t bgzf_block_size(const unsigned char* p, size_t size)
+{
+    if (!is_gzip(p, size) || size < GZIP_HEADER || (p[3] & GZIP_FEXTRA) == 0)
+        return 0;
+    
+    const size_t extra = read_le(p + 10, 2);
+    if (GZIP_HEADER + extra > size)
+        return 0;
+    
+    // The BC subfield holds the block size - 1
+    for (size_t i = GZIP_HEADER; i + 4 <= GZIP_HEADER + extra;) {
+        const size_t length = read_le(p + i + 2, 2);
+        if (p[i] == 'B' && p[i + 1] == 'C' && length == 2 && i + 6 <= GZIP_HEADER + extra)
+            return read_le(p + i + 4, 2) + 1;
+        i += 4 + length;
+    }
+    return 0;
+}
+
+Compression detect_compression(const char* data, size_t size)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    if (bgzf_block_size(p, size) > 0)
+        return Compression::Bgzf;
+    if (is_gzip(p, size))
+        return Compression::Gzip;
+    return Compression::None;
+}
+
+/**
+ * Ends a zlib stream however the scope is left.
+ */
+struct InflateStream
+{
+    InflateStream(int windowBits) {
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        stream.next_in = Z_NULL;
+        stream.avail_in = 0;
+        if (inflateInit2(&stream, windowBits) != Z_OK)
+            throw runtime_error("Could not start decompression!");
+    }
+    
+    ~InflateStream() {
+        inflateEnd(&stream);
+    }
+    
+    z_stream stream;
+};
+
+bool gunzip(const char* data, size_t size, function<bool(const char*, size_t)> consume)
+{
+    InflateStream inflater(15 + 16);
+    z_stream& stream = inflater.stream;
+    vector<char> buffer(size_t(1) << 18);
+    
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data);
+    size_t remaining = size;
+    while (true) {
+        if (stream.avail_in == 0 && remaining > 0) {
+            stream.next_in = const_cast<unsigned char*>(in);
+            stream.avail_in = uInt(min(remaining, INFLATE_INPUT));
+            in += stream.avail_in;
+            remaining -= stream.avail_in;
+        }
+        
+        stream.next_out = reinterpret_cast<unsigned char*>(buffer.data());
+        stream.avail_out = uInt(buffer.size());
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            throw runtime_error("Corrupt gzip data!");
+        
+        const size_t produced = buffer.size() - stream.avail_out;
+        if (produced > 0 && !consume(buffer.data(), produced))
+            return false;
+        
+        if (result == Z_STREAM_END) {
+            // Another member may follow
+            const unsigned char* next = stream.next_in;
+            const size_t left = stream.avail_in + remaining;
+            if (left == 0 || (stream.avail_in > 0 && !is_gzip(next, stream.avail_in)))
+                return true;
+            inflateReset(&stream);
+        } else if (result == Z_BUF_ERROR && stream.avail_in == 0 && remaining == 0) {
+            throw runtime_error("Truncated gzip data!");
+        }
+    }
+}
+
+/**
+ * A BGZF block: its deflate payload and the size and CRC of its contents.
+ */
+struct BgzfBlock
+{
+    const unsigned char* payload;
+    size_t payloadSize;
+    uint32_t crc;
+    size_t size;
+};
+
+static void inflate_block(const BgzfBlock& block, vector<char>& out)
+{
+    out.resize(block.size);
+    if (block.size == 0)
+        return;
+    
+    InflateStream inflater(-15);
+    z_stream& stream = inflater.stream;
+    stream.next_in = const_cast<unsigned char*>(block.payload);
+    stream.avail_in = uInt(block.payloadSize);
+    stream.next_out = reinterpret_cast<unsigned char*>(out.data());
+    stream.avail_out = uInt(out.size());
+    
+    if (inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_out != 0)
+        throw runtime_error("Corrupt BGZF block!");
+    if (crc32(0, reinterpret_cast<const unsigned char*>(out.data()), uInt(out.size())) != block.crc)
+        throw runtime_error("BGZF block fails its checksum!");
+}
+
+bool bgzf_decompress(const char* data, size_t size, ThreadPool* pool, function<bool(const char*, size_t)> consume)
+{
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const size_t batch = pool != nullptr ? 4 * pool->size() : 1;
+    
+    vector<BgzfBlock> blocks;
+    vector<vector<char>> outputs(batch);
+    size_t offset = 0;
+    while (offset < size) {
+        // Find the next batch of blocks from their headers alone
+        blocks.clear();
+        while (offset < size && blocks.size() < batch) {
+            const size_t blockSize = bgzf_block_size(p + offset, size - offset);
+            if (blockSize == 0 || offset + blockSize > size)
+                throw runtime_error("Corrupt BGZF data!");
+            
+            const size_t header = GZIP_HEADER + read_le(p + offset + 10, 2);
+            if (header + GZIP_TRAILER > blockSize)
+                throw runtime_error("Corrupt BGZF data!");
+            
+            const unsigned char* trailer = p + offset + blockSize - GZIP_TRAILER;
+            blocks.push_back({ p + offset + header, blockSize - header - GZIP_TRAILER,
+                               read_le(trailer, 4), read_le(trailer + 4, 4) });
+            offset += blockSize;
+        }
+        
+        if (pool != nullptr)
+            pool->parallelFor(blocks.size(), [&blocks, &outputs] (size_t b) { inflate_block(blocks[b], outputs[b]); });
+        else
+            inflate_block(blocks[0], outputs[0]);
+        
+        for (size_t b = 0; b < blocks.size(); b++) {
+            if (!outputs[b].empty() && !consume(outputs[b].data(), outputs[b].size()))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool decompress(const char* data, size_t size, ThreadPool* pool, function<bool(const char*, size_t)> consume)
+{
+    switch (detect_compression(data, size)) {
+        case Compression::Bgzf:
+            return bgzf_decompress(data, size, pool, consume);
+        case Compression::Gzip:
+            return gunzip(data, size, consume);
+        default:
+            return size == 0 || consume(data, size);
+    }
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <functional>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+enum class Compression { None, Gzip, Bgzf };
+
+/**
+ * Tell plain data from gzip and BGZF, the blocked gzip of samtools.
+ */
+Compression detect_compression(const char* data, size_t size);
+
+/*
+ * The decompressors hand their output to consume(data, n) in pieces, in
+ * order, and stop as soon as it returns false, in which case they return
+ * false too. Corrupt input throws a runtime_error.
+ */
+
+/**
+ * Decompress gzip data of one or more members on the calling thread.
+ */
+bool gunzip(const char* data, size_t size, function<bool(const char*, size_t)> consume);
+
+/**
+ * Decompress BGZF data. The blocks are independent, so batches of them
+ * are decompressed on the threads of pool, or in turn if pool is null.
+ */
+bool bgzf_decompress(const char* data, size_t size, ThreadPool* pool, function<bool(const char*, size_t)> consume);
+
+/**
+ * Hand over data as it is, or decompressed if it is gzip or BGZF.
+ */
+bool decompress(const char* data, size_t size, ThreadPool* pool, function<bool(const char*, size_t)> consume);
@@ -9,71 +9,117 @@
 
 using namespace std;
 
-void train_by_counting(HMM& model, vector<string> observations, vector<vector<string>> annotations)
+/**
+ * Transition, start and emission counts of annotated observations.
+ */
+class Counts
 {
-    if (model.isFinalized())
-        throw invalid_argument("Model must not be finalized!");
-    model.reset();
+public:
+    Counts(size_t states) : A(states, states, 0), pi(states, 0), emissions(states, map<uint64_t,size_t>())
+    { }
     
-    Matrix<size_t> A(model.numStates(), model.numStates(), 0);
-    vector<size_t> pi(model.numStates(), 0);
-    vector<map<string,size_t>> emissions(model.numStates(), map<string,size_t>());
-    auto countEmission = [&emissions] (size_t state, string obs) {
-        if (emissions[state].count(obs) > 0)
-            emissions[state].at(obs)++;
+    Matrix<size_t> A;
+    vector<size_t> pi;
+    vector<map<uint64_t,size_t>> emissions;
+};
+
+static void count_observation(const HMM& model, const Sequence& observation, const vector<string>& annotation,
+                              Counts& counts)
+{
+    auto countEmission = [&counts, &model, &observation] (size_t state, size_t pos) {
+        size_t arity = model.stateArity(state);
+        if (pos + arity > observation.length() || observation.ambiguityMask(pos, arity) != 0)
+            return;
+        
+        uint64_t obs = observation.kmer(pos, arity);
+        if (counts.emissions[state].count(obs) > 0)
+            counts.emissions[state].at(obs)++;
         else
-            emissions[state][obs] = 0;
+            counts.emissions[state][obs] = 0;
     };
     
-    for (int i = 0; i < observations.size(); i++) {
-        size_t curpos = 0;
+    size_t curpos = 0;
+    
+    for (int j = 0; j < annotation.size()-1; j++) {
+        size_t curstate = model.getState(annotation[j]);
         
-        for (int j = 0; j < annotations[i].size()-1; j++) {
-            size_t curstate = model.getState(annotations[i][j]);
-            
-            A(curstate, model.getState(annotations[i][j+1]))++;
-            
-            string obs = observations[i].substr(curpos, model.stateArity(curstate));
-            countEmission(curstate, obs);
-            
-            curpos += model.stateArity(curstate);
-        }
+        counts.A(curstate, model.getState(annotation[j+1]))++;
         
-        size_t laststate = model.getState(annotations[i][annotations[i].size()-1]);
-        string lastobs = observations[i].substr(curpos, model.stateArity(laststate));
-        countEmission(laststate, lastobs);
+        countEmission(curstate, curpos);
         
-        pi[model.getState(annotations[i][0])]++;
+        curpos += model.stateArity(curstate);
     }
     
-    auto sumA = [&model, &A] (size_t row) {
+    size_t laststate = model.getState(annotation[annotation.size()-1]);
+    countEmission(laststate, curpos);
+    
+    counts.pi[model.getState(annotation[0])]++;
+}
+
+static void set_counted_probs(HMM& model, const Counts& counts)
+{
+    auto sumA = [&model, &counts] (size_t row) {
         size_t sum = 0;
         for (size_t j = 0; j < model.numStates(); j++)
-            sum += A(row, j);
+            sum += counts.A(row, j);
         return sum;
     };
     
-    auto sumEmission = [&emissions] (size_t state) {
+    auto sumEmission = [&counts] (size_t state) {
         size_t sum = 0;
-        for (auto emission : emissions[state])
+        for (auto emission : counts.emissions[state])
             sum += emission.second;
         return sum;
     };
     
-    auto sumPi = [&model, &pi] () {
+    auto sumPi = [&model, &counts] () {
         size_t sum = 0;
         for (size_t i = 0; i < model.numStates(); i++)
-            sum += pi[i];
+            sum += counts.pi[i];
         return sum;
     };
     
     for (int i = 0; i < model.numStates(); i++) {
         for (int j = 0; j < model.numStates(); j++)
-            model.setTransitionProb(i, j, (double) A(i, j) / sumA(i));
+            model.setTransitionProb(i, j, (double) counts.A(i, j) / sumA(i));
         
-        for (auto emission : emissions[i])
-            model.setEmissionProb(i, emission.first, (double) emission.second / sumEmission(i));
+        for (auto emission : counts.emissions[i])
+            model.setEmissionProb(i, Sequence::kmerString(emission.first, model.stateArity(i)),
+                                  (double) emission.second / sumEmission(i));
         
-        model.setStartProb(i, (double) pi[i] / sumPi());
+        model.setStartProb(i, (double) counts.pi[i] / sumPi());
     }
 }
+
+void train_by_counting(HMM& model, const vector<Sequence>& observations, const vector<vector<string>>& annotations)
+{
+    if (model.isFinalized())
+        throw invalid_argument("Model must not be finalized!");
+    model.reset();
+    
+    Counts counts(model.numStates());
+    for (int i = 0; i < observations.size(); i++)
+        count_observation(model, observations[i], annotations[i], counts);
+    
+    set_counted_probs(model, counts);
+}
+
+void train_by_counting(HMM& model, function<bool(Sequence&, vector<string>&)> next)
+{
+    if (model.isFinalized())
+        throw invalid_argument("Model must not be finalized!");
+    model.reset();
+    
+    Counts counts(model.numStates());
+    Sequence observation;
+    vector<string> annotation;
+    while (next(observation, annotation))
+        count_observation(model, observation, annotation, counts);
+    
+    set_counted_probs(model, counts);
+}
+
+void train_by_counting(HMM& model, vector<string> observations, vector<vector<string>> annotations)
+{
+    train_by_counting(model, vector<Sequence>(observations.begin(), observations.end()), annotations);
+}
@@ -2,9 +2,19 @@
 
 #include <vector>
 #include <string>
+#include <functional>
 
 #include "HMM.h"
+#include "Sequence.h"
 
 using namespace std;
 
+void train_by_counting(HMM& model, const vector<Sequence>& observations, const vector<vector<string>>& annotations);
 void train_by_counting(HMM& model, vector<string> observations, vector<vector<string>> annotations);
+
+/**
+ * Train from annotated observations pulled one at a time, e.g. from a
+ * FastaReader. next(observation, annotation) fills in the next pair and
+ * returns false when there are no more.
+ */
+void train_by_counting(HMM& model, function<bool(Sequence&, vector<string>&)> next);
@@ -0,0 +1,78 @@
+#include <cstdlib>
+#include <new>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+#include <sys/mman.h>
+
+#include "DPWorkspace.h"
+
+using namespace std;
+
+static const size_t CACHE_LINE = 64;
+static const size_t HUGE_PAGE = size_t(2) << 20;
+
+size_t DPWorkspace::bytes() const
+{
+    size_t total = 0;
+    for (const Buffer& buffer : buffers)
+        total += buffer.bytes;
+    return total;
+}
+
+void DPWorkspace::release()
+{
+    for (Buffer& buffer : buffers)
+        free(buffer.data);
+    buffers.clear();
+}
+
+void* DPWorkspace::reserve(size_t slot, size_t bytes)
+{
+    if (slot >= buffers.size())
+        buffers.resize(slot + 1, Buffer{ nullptr, 0 });
+    
+    Buffer& buffer = buffers[slot];
+    if (bytes <= buffer.bytes && buffer.data != nullptr)
+        return buffer.data;
+    
+    // Grow by half at least, so slowly growing lengths settle quickly
+    size_t size = max(bytes, buffer.bytes + buffer.bytes / 2);
+    const size_t alignment = hugePages && size >= HUGE_PAGE ? HUGE_PAGE : CACHE_LINE;
+    size = (max<size_t>(size, 1) + alignment - 1) / alignment * alignment;
+    
+    free(buffer.data);
+    buffer.data = nullptr;
+    buffer.bytes = 0;
+    
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, alignment, size) != 0)
+        throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+    if (alignment == HUGE_PAGE)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    
+    buffer.data = ptr;
+    buffer.bytes = size;
+    grown++;
+    return ptr;
+}
+
+unique_ptr<DPWorkspace> WorkspacePool::borrow()
+{
+    unique_lock<mutex> guard(lock);
+    if (spare.empty())
+        return unique_ptr<DPWorkspace>(new DPWorkspace(hugePages));
+    
+    unique_ptr<DPWorkspace> workspace = move(spare.back());
+    spare.pop_back();
+    return workspace;
+}
+
+void WorkspacePool::giveBack(unique_ptr<DPWorkspace> workspace)
+{
+    unique_lock<mutex> guard(lock);
+    spare.push_back(move(workspace));
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <type_traits>
+
+#include "Matrix.h"
+
+using namespace std;
+
+/**
+ * Buffers for the tables of the dynamic programs, kept from one call to the
+ * next so that decoding or training many sequences of similar length only
+ * allocates while warming up. Every buffer is aligned to a cache line and
+ * only ever grows.
+ *
+ * A call borrows buffers by slot number and holds them until it returns, so
+ * a workspace serves one call at a time and the tables a call hands out
+ * are only valid until the next call using the same workspace.
+ *
+ * With hugePages, buffers of 2 MB or more are aligned to 2 MB and the
+ * kernel is asked to back them by transparent huge pages where supported,
+ * which saves page faults and TLB misses on long sequences.
+ */
+class DPWorkspace
+{
+public:
+    explicit DPWorkspace(bool hugePages = false) : hugePages(hugePages), grown(0)
+    { }
+    
+    ~DPWorkspace() { release(); }
+    
+    DPWorkspace(const DPWorkspace&) = delete;
+    DPWorkspace& operator=(const DPWorkspace&) = delete;
+    
+    /**
+     * Room for count values of T in slot, with undefined contents.
+     */
+    template<class T>
+    T* buffer(size_t slot, size_t count) {
+        static_assert(is_trivial<T>::value, "Workspace buffers hold plain values only!");
+        return static_cast<T*>(reserve(slot, count * sizeof(T)));
+    }
+    
+    /**
+     * Room for count values of T in slot, all set to value.
+     */
+    template<class T>
+    T* buffer(size_t slot, size_t count, const T& value) {
+        T* values = buffer<T>(slot, count);
+        fill(values, values + count, value);
+        return values;
+    }
+    
+    /**
+     * A rows x columns table in slot with every cell set to value. Rows are
+     * padded like those of a Matrix.
+     */
+    template<class T>
+    MatrixView<T> table(size_t slot, size_t rows, size_t columns, const T& value) {
+        const size_t stride = matrix_row_width<T>(columns);
+        return MatrixView<T>(buffer<T>(slot, rows * stride, value), rows, columns, stride);
+    }
+    
+    /**
+     * Bytes held in all buffers.
+     */
+    size_t bytes() const;
+    
+    /**
+     * Number of times a buffer had to grow.
+     */
+    size_t allocations() const { return grown; }
+    
+    /**
+     * Give all buffers back to the system.
+     */
+    void release();
+
+private:
+    void* reserve(size_t slot, size_t bytes);
+    
+    struct Buffer
+    {
+        void* data;
+        size_t bytes;
+    };
+    
+    bool hugePages;
+    size_t grown;
+    vector<Buffer> buffers;
+};
+
+/**
+ * Workspaces for the tasks of a thread pool. A task borrows a workspace no
+ * other task holds and gives it back once done, so the workspaces outlive
+ * the tasks and at most one is made per task running at the same time.
+ */
+class WorkspacePool
+{
+public:
+    explicit WorkspacePool(bool hugePages = false) : hugePages(hugePages)
+    { }
+    
+    unique_ptr<DPWorkspace> borrow();
+    void giveBack(unique_ptr<DPWorkspace> workspace);
+
+private:
+    bool hugePages;
+    
+    mutex lock;
+    vector<unique_ptr<DPWorkspace>> spare;
+};
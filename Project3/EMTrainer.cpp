@@ -1,90 +1,521 @@
 #include <vector>
 #include <string>
 #include <iostream>
+#include <memory>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
 
 #include "EMTrainer.h"
 #include "HMM.h"
 #include "ForwardBackward.h"
+#include "EmissionStream.h"
+#include "ThreadPool.h"
+#include "FastaReader.h"
+#include "AlignedAllocator.h"
+#include "RegionDecoding.h"
+#include "DPWorkspace.h"
 
 using namespace std;
 
-void train_by_baumwelch(HMM& model, vector<string> observations)
+/**
+ * Expected emission counts of a state by k-mer code. Like EmissionTable,
+ * they are dense up to EmissionTable::MAX_DENSE_ARITY, so gathering them
+ * never allocates, and hashed above it, where 4^d counts would not fit.
+ */
+class EmissionCounts
 {
-    Matrix<double> A(model.numStates(), model.numStates(), 0);
-    vector<double> pi(model.numStates(), 0);
-
-    vector<map<string,double>> emissions(model.numStates(), map<string,double>());
-    vector<double> throughStateProbs(model.numStates(), 0);
+public:
+    EmissionCounts(size_t d) : dense(d <= EmissionTable::MAX_DENSE_ARITY) {
+        if (dense)
+            counts.assign(size_t(1) << (2 * d), 0);
+    }
     
-    model.finalize();
+    inline double& operator[](uint64_t code) {
+        return dense ? counts[code] : sparse[code];
+    }
+    
+    void add(const EmissionCounts& other, double weight) {
+        if (dense) {
+            for (size_t code = 0; code < counts.size(); code++)
+                counts[code] += weight * other.counts[code];
+        } else {
+            for (auto count : other.sparse)
+                sparse[count.first] += weight * count.second;
+        }
+    }
+    
+    void scale(double factor) {
+        for (double& count : counts)
+            count *= factor;
+        for (auto& count : sparse)
+            count.second *= factor;
+    }
     
-    for (auto observation : observations) {
-        auto FBtable = forward_backward(observation, model);
+    /**
+     * Call visit(code, count) for every count other than 0, by code.
+     */
+    template<class Visit>
+    void forEach(Visit visit) const {
+        if (dense) {
+            for (size_t code = 0; code < counts.size(); code++) {
+                if (counts[code] != 0)
+                    visit(code, counts[code]);
+            }
+            return;
+        }
         
-        auto gamma = [&model, &FBtable] (size_t n, size_t state) {
+        vector<pair<uint64_t, double>> sorted(sparse.begin(), sparse.end());
+        sort(sorted.begin(), sorted.end());
+        for (auto count : sorted) {
+            if (count.second != 0)
+                visit(count.first, count.second);
+        }
+    }
+
+private:
+    bool dense;
+    aligned_vector<double> counts;
+    unordered_map<uint64_t, double> sparse;
+};
+
+/**
+ * Expected counts gathered by the E-step.
+ */
+class ExpectedCounts
+{
+public:
+    ExpectedCounts(const HMM& model) : A(model.numStates(), model.numStates(), 0), pi(model.numStates(), 0),
+                                       throughStateProbs(model.numStates(), 0), logLikelihood(0)
+    {
+        for (size_t i = 0; i < model.numStates(); i++)
+            emissions.push_back(EmissionCounts(model.stateArity(i)));
+    }
+    
+    void add(const ExpectedCounts& other, double weight = 1) {
+        for (size_t i = 0; i < pi.size(); i++) {
+            for (size_t j = 0; j < pi.size(); j++)
+                A(i, j) += weight * other.A(i, j);
+            pi[i] += weight * other.pi[i];
+            
+            emissions[i].add(other.emissions[i], weight);
+            throughStateProbs[i] += weight * other.throughStateProbs[i];
+        }
+        logLikelihood += weight * other.logLikelihood;
+    }
+    
+    void scale(double factor) {
+        A.map([factor] (double count) { return count * factor; });
+        for (size_t i = 0; i < pi.size(); i++) {
+            pi[i] *= factor;
+            emissions[i].scale(factor);
+            throughStateProbs[i] *= factor;
+        }
+        logLikelihood *= factor;
+    }
+    
+    Matrix<double> A;
+    vector<double> pi;
+    
+    vector<EmissionCounts> emissions;
+    vector<double> throughStateProbs;
+    
+    // Of the observations under the model, from the forward scales
+    double logLikelihood;
+};
+
+/**
+ * The part of an observation a work item of the E-step gathers counts
+ * for: the windows ending in [begin, end), found by running
+ * forward-backward over the symbols [from, to) around them. first and last
+ * tell whether it starts and ends a record.
+ */
+struct Segment
+{
+    size_t observation, from, to, begin, end;
+    bool first, last;
+};
+
+/**
+ * Add the counts of the windows ending in [begin, end) of observation.
+ * Start probs are only counted if it is the first part of a sequence,
+ * and the window ending at the last symbol is only left out if it is
+ * the last part.
+ */
+static void expected_counts(const HMM& model, const Sequence& observation, size_t memoryBudget, ExpectedCounts& counts,
+                            DPWorkspace* workspace, size_t begin = 0, size_t end = numeric_limits<size_t>::max(),
+                            bool first = true, bool last = true)
+{
+    EmissionStream emissionStream(model, observation);
+    
+    // Every (n, k) is visited at the position l = n + stateArity(k) - 1
+    // where its window ends, so a block only looks back in the tables
+    auto visit = [&] (const ForwardBackwardBlock& table) {
+        auto gamma = [&model, &table] (size_t n, size_t state) {
             size_t pos = n + model.stateArity(state) - 1;
-            return get<1>(FBtable)(pos, state) * get<2>(FBtable)(pos, state);
+            return table.forward(pos, state) * table.backward(pos, state);
         };
         
-        for (size_t k = 0; k < model.numStates(); k++) {
-            for (size_t n = 0; n < observation.length(); n++) {
-                if (n + model.stateArity(k) >= observation.length())
+        for (size_t l = max(table.begin(), begin); l < min(table.end(), end); l++) {
+            counts.logLikelihood += log(table.scale(l));
+            
+            for (size_t k = 0; k < model.numStates(); k++) {
+                if (l + 1 < model.stateArity(k))
                     continue;
+                size_t n = l + 1 - model.stateArity(k);
                 
-                string obs = observation.substr(n, model.stateArity(k));
-                double emissionProb = model.emissionProb(k, obs);
+                if (n == 0 && first)
+                    counts.pi[k] += gamma(0, k);
+                
+                if (n + model.stateArity(k) >= observation.length() && last)
+                    continue;
                 
                 if (n > 0) {
-                    // Transition probabilities
+                    // Transition probabilities, only along possible transitions
                     double C = 1;
                     for (int i = 0; i < model.stateArity(k); i++)
-                        C *= get<0>(FBtable)[n+i];
+                        C *= table.scale(n+i);
                     
-                    for (size_t j = 0; j < model.numStates(); j++) {
-                        A(j, k) += get<1>(FBtable)(n-1, j) * get<2>(FBtable)(n + model.stateArity(k) - 1, k)
-                        * (emissionProb * model.transitionProb(j, k)) / C;
-                    }
+                    const double into = table.backward(l, k) * emissionStream.probAt(k, l) / C;
+                    Span<const size_t> incomming = model.incommingStates(k);
+                    Span<const double> probs = model.incommingProbs(k);
+                    for (size_t j = 0; j < incomming.size(); j++)
+                        counts.A(incomming[j], k) += table.forward(n-1, incomming[j]) * probs[j] * into;
                 }
                 
                 // Emission probabilities
+                if (observation.ambiguityMask(n, model.stateArity(k)) != 0)
+                    continue;
+                
                 double gamma_nk = gamma(n, k);                
-                if (emissions[k].count(obs) > 0)
-                    emissions[k].at(obs) += gamma_nk;
-                else
-                    emissions[k][obs] = gamma_nk;
-                throughStateProbs[k] += gamma_nk;
+                counts.emissions[k][observation.kmer(n, model.stateArity(k))] += gamma_nk;
+                counts.throughStateProbs[k] += gamma_nk;
             }
-            
-            pi[k] += gamma(0, k);
         }
-    }
-    
-    model.unlock();
-    model.reset();
+    };
     
-    // Update the model
-    auto sumA = [&model, &A] (size_t row) {
+    forward_backward_blocks(observation, model, memoryBudget, visit, workspace);
+}
+
+static void update_model(HMM& model, const ExpectedCounts& counts)
+{
+    auto sumA = [&model, &counts] (size_t row) {
         double sum = 0;
         for (size_t j = 0; j < model.numStates(); j++)
-            sum += A(row, j);
+            sum += counts.A(row, j);
         return sum;
     };
     
-    auto sumPi = [&model, &pi] () {
+    auto sumPi = [&model, &counts] () {
         double sum = 0;
         for (size_t i = 0; i < model.numStates(); i++)
-            sum += pi[i];
+            sum += counts.pi[i];
         return sum;
     };
     
     for (int i = 0; i < model.numStates(); i++) {
         for (int j = 0; j < model.numStates(); j++)
-            model.setTransitionProb(i, j, A(i, j) / sumA(i));
+            model.setTransitionProb(i, j, counts.A(i, j) / sumA(i));
+        
+        counts.emissions[i].forEach([&model, &counts, i] (uint64_t code, double count) {
+            model.setEmissionProb(i, Sequence::kmerString(code, model.stateArity(i)),
+                                  count / counts.throughStateProbs[i]);
+        });
+        
+        model.setStartProb(i, counts.pi[i] / sumPi());
+    }
+}
+
+/**
+ * Cut observations longer than twice segmentLength into segments of
+ * about that length, each run with burnIn symbols on either side. An
+ * observation that is not cut is a single segment. Observations are whole
+ * records unless chunks says where each of them lies in its record.
+ */
+static vector<Segment> segment_observations(const vector<Sequence>& observations, size_t segmentLength, size_t burnIn,
+                                            const vector<FastaChunk>& chunks)
+{
+    vector<Segment> segments;
+    for (size_t i = 0; i < observations.size(); i++) {
+        const size_t L = observations[i].length();
+        const bool startsRecord = chunks.empty() || chunks[i].offset == 0;
+        const bool endsRecord = chunks.empty() || chunks[i].endsRecord;
+        const size_t parts = segmentLength > 0 ? max<size_t>(1, L / segmentLength) : 1;
+        for (size_t p = 0; p < parts; p++) {
+            const size_t begin = p * L / parts, end = (p + 1) * L / parts;
+            const size_t from = begin > burnIn ? begin - burnIn : 0, to = min(L, end + burnIn);
+            segments.push_back({ i, from, to, begin, end, from == 0 && startsRecord, to == L && endsRecord });
+        }
+    }
+    return segments;
+}
+
+/**
+ * Split the segments into at most parts contiguous ranges of about the
+ * same total length. Range p is [bounds[p], bounds[p+1]).
+ */
+static vector<size_t> partition_by_length(const vector<Segment>& segments, size_t parts)
+{
+    size_t total = 0;
+    for (const Segment& segment : segments)
+        total += segment.to - segment.from;
+    
+    parts = max<size_t>(1, min(parts, segments.size()));
+    vector<size_t> bounds(1, 0);
+    size_t seen = 0;
+    for (size_t i = 0; i < segments.size(); i++) {
+        seen += segments[i].to - segments[i].from;
+        if (bounds.size() < parts && seen * parts >= total * bounds.size() && i + 1 < segments.size())
+            bounds.push_back(i + 1);
+    }
+    bounds.push_back(segments.size());
+    return bounds;
+}
+
+/**
+ * Add the expected counts of the observations to total, with the E-step
+ * spread over the threads of pool. With a segmentLength other than 0,
+ * long observations are cut into segments so that a single one is
+ * spread as well. Observations may be chunks of records, as described by
+ * chunks, and are whole records if it is empty.
+ */
+static void parallel_expected_counts(const HMM& model, const vector<Sequence>& observations, ThreadPool& pool,
+                                     size_t memoryBudget, size_t segmentLength, size_t burnIn,
+                                     WorkspacePool& workspaces, ExpectedCounts& total,
+                                     const vector<FastaChunk>& chunks = vector<FastaChunk>())
+{
+    const vector<Segment> segments = segment_observations(observations, segmentLength, burnIn, chunks);
+    
+    // Segments inside a record do not start where the start probs apply,
+    // so they are run from the averaged state distribution instead, found
+    // once for all of them
+    unique_ptr<HMM> interior;
+    for (const Segment& segment : segments) {
+        if (!segment.first) {
+            interior.reset(new HMM(interior_model(model)));
+            break;
+        }
+    }
+    
+    // Every worker sums a fixed range of segments into its own counts, and
+    // the counts are reduced in order, so a given number of threads always
+    // gives the same result
+    vector<size_t> bounds = partition_by_length(segments, pool.size());
+    vector<ExpectedCounts> counts(bounds.size() - 1, ExpectedCounts(model));
+    pool.parallelFor(counts.size(), [&] (size_t p) {
+        unique_ptr<DPWorkspace> workspace = workspaces.borrow();
+        for (size_t i = bounds[p]; i < bounds[p + 1]; i++) {
+            const Segment& segment = segments[i];
+            const Sequence& observation = observations[segment.observation];
+            const HMM& start = segment.first ? model : *interior;
+            if (segment.from == 0 && segment.to == observation.length()) {
+                expected_counts(start, observation, memoryBudget, counts[p], workspace.get(), 0,
+                                numeric_limits<size_t>::max(), segment.first, segment.last);
+                continue;
+            }
+            
+            const Sequence part(observation.substr(segment.from, segment.to - segment.from));
+            expected_counts(start, part, memoryBudget, counts[p], workspace.get(),
+                            segment.begin - segment.from, segment.end - segment.from, segment.first, segment.last);
+        }
+        workspaces.giveBack(move(workspace));
+    });
+    
+    for (size_t p = 0; p < counts.size(); p++)
+        total.add(counts[p]);
+}
+
+/**
+ * Baum-Welch iteration on the threads of pool, with tables borrowed from
+ * workspaces kept by the caller across iterations.
+ */
+static double baumwelch_iteration(HMM& model, const vector<Sequence>& observations, ThreadPool& pool,
+                                  size_t memoryBudget, size_t segmentLength, size_t burnIn, WorkspacePool& workspaces)
+{
+    model.finalize();
+    
+    ExpectedCounts counts(model);
+    parallel_expected_counts(model, observations, pool, memoryBudget, segmentLength, burnIn, workspaces, counts);
+    
+    model.unlock();
+    model.reset();
+    update_model(model, counts);
+    return counts.logLikelihood;
+}
+
+double train_by_baumwelch(HMM& model, const vector<Sequence>& observations, ThreadPool& pool, size_t memoryBudget,
+                          size_t segmentLength, size_t burnIn)
+{
+    WorkspacePool workspaces;
+    return baumwelch_iteration(model, observations, pool, memoryBudget, segmentLength, burnIn, workspaces);
+}
+
+double train_by_baumwelch(HMM& model, FastaReader& observations, ThreadPool& pool, size_t memoryBudget)
+{
+    model.finalize();
+    
+    // Chunks after the first of a record do not start where the start probs
+    // apply, so they are run from the averaged state distribution instead
+    const HMM interior = interior_model(model);
+    
+    // Counts are kept per chunk and summed in the order the chunks are read
+    ExpectedCounts total(model);
+    WorkspacePool workspaces;
+    typedef pair<FastaChunk, unique_ptr<ExpectedCounts>> Item;
+    pool.pipeline<Item>([&observations, &model] (Item& item) {
+        while (observations.next(item.first)) {
+            if (item.first.sequence.length() > 0) {
+                item.second.reset(new ExpectedCounts(model));
+                return true;
+            }
+        }
+        return false;
+    }, [&model, &interior, memoryBudget, &workspaces] (Item& item) {
+        const bool first = item.first.offset == 0;
+        unique_ptr<DPWorkspace> workspace = workspaces.borrow();
+        expected_counts(first ? model : interior, item.first.sequence, memoryBudget, *item.second, workspace.get(),
+                        0, numeric_limits<size_t>::max(), first, item.first.endsRecord);
+        workspaces.giveBack(move(workspace));
+    }, [&total] (Item& item) {
+        total.add(*item.second);
+    }, 2 * pool.size());
+    
+    model.unlock();
+    model.reset();
+    update_model(model, total);
+    return total.logLikelihood;
+}
+
+double train_by_baumwelch(HMM& model, const vector<Sequence>& observations, size_t memoryBudget)
+{
+    ExpectedCounts counts(model);
+    DPWorkspace workspace;
+    
+    model.finalize();
+    
+    for (const Sequence& observation : observations)
+        expected_counts(model, observation, memoryBudget, counts, &workspace);
+    
+    model.unlock();
+    model.reset();
+    update_model(model, counts);
+    return counts.logLikelihood;
+}
+
+double train_by_baumwelch(HMM& model, vector<string> observations)
+{
+    return train_by_baumwelch(model, vector<Sequence>(observations.begin(), observations.end()));
+}
+
+/**
+ * Largest change of any start, transition or emission prob between two
+ * models over the same states.
+ */
+static double parameter_delta(const HMM& before, const HMM& after)
+{
+    double delta = 0;
+    for (size_t i = 0; i < after.numStates(); i++) {
+        delta = max(delta, abs(after.startProb(i) - before.startProb(i)));
+        for (size_t j = 0; j < after.numStates(); j++)
+            delta = max(delta, abs(after.transitionProb(i, j) - before.transitionProb(i, j)));
+        
+        auto emissions = before.getEmissions(i);
+        for (auto emission : after.getEmissions(i)) {
+            auto it = emissions.find(emission.first);
+            delta = max(delta, abs(emission.second - (it != emissions.end() ? it->second : 0)));
+            if (it != emissions.end())
+                emissions.erase(it);
+        }
+        for (auto emission : emissions)
+            delta = max(delta, emission.second);
+    }
+    return delta;
+}
+
+vector<double> train_until_converged(HMM& model, const vector<Sequence>& observations, ThreadPool& pool,
+                                     const BaumWelchOptions& options)
+{
+    if (model.isFinalized())
+        model.unlock();
+    
+    // The tables of one iteration are reused by the next
+    WorkspacePool workspaces(options.hugePages);
+    vector<double> logLikelihoods;
+    for (size_t iteration = 1; iteration <= options.maxIterations; iteration++) {
+        HMM before(model);
+        const double logLikelihood = baumwelch_iteration(model, observations, pool, options.memoryBudget,
+                                                         options.segmentLength, options.burnIn, workspaces);
+        logLikelihoods.push_back(logLikelihood);
+        if (options.progress)
+            options.progress(iteration, logLikelihood);
+        
+        // The log-likelihood is that of the model before the iteration, so
+        // the improvement seen here is from the iteration before
+        bool converged = options.minParameterDelta > 0 && parameter_delta(before, model) < options.minParameterDelta;
+        if (logLikelihoods.size() > 1) {
+            const double previous = logLikelihoods[logLikelihoods.size() - 2];
+            converged = converged || logLikelihood - previous < options.minRelativeImprovement * abs(logLikelihood);
+        }
         
-        for (auto emission : emissions[i]) {
-            model.setEmissionProb(i, emission.first, emission.second / throughStateProbs[i]);
+        const bool last = converged || iteration == options.maxIterations;
+        if (options.sideWork && (last || (options.sideWorkInterval > 0 && iteration % options.sideWorkInterval == 0))) {
+            model.finalize();
+            options.sideWork(iteration, model);
+            model.unlock();
+        }
+        if (last)
+            break;
+    }
+    return logLikelihoods;
+}
+
+size_t train_by_online_em(HMM& model, FastaReader& observations, ThreadPool& pool, const OnlineEMOptions& options)
+{
+    if (!model.isFinalized())
+        model.finalize();
+    
+    // Statistics are kept per symbol, so batches of any length weigh the same
+    ExpectedCounts statistics(model);
+    WorkspacePool workspaces(options.hugePages);
+    vector<Sequence> batch;
+    vector<FastaChunk> chunks;
+    size_t batches = 0;
+    while (true) {
+        batch.clear();
+        chunks.clear();
+        size_t symbols = 0;
+        FastaChunk chunk;
+        while (symbols < options.batchLength && observations.next(chunk)) {
+            if (chunk.sequence.length() == 0)
+                continue;
+            symbols += chunk.sequence.length();
+            batch.push_back(move(chunk.sequence));
+            
+            // Where the chunk lies in its record, without its symbols
+            chunks.push_back(FastaChunk());
+            chunks.back().offset = chunk.offset;
+            chunks.back().endsRecord = chunk.endsRecord;
         }
+        if (batch.empty())
+            break;
         
-        model.setStartProb(i, pi[i] / sumPi());
+        ExpectedCounts counts(model);
+        parallel_expected_counts(model, batch, pool, options.memoryBudget, 0, 0, workspaces, counts, chunks);
+        batches++;
+        
+        const double step = pow((1 + options.stepOffset) / (batches + options.stepOffset), options.stepDecay);
+        statistics.scale(1 - step);
+        statistics.add(counts, step / symbols);
+        if (options.progress)
+            options.progress(batches, counts.logLikelihood / symbols);
+        
+        model.unlock();
+        model.reset();
+        update_model(model, statistics);
+        model.finalize();
     }
+    
+    model.unlock();
+    return batches;
 }
@@ -2,9 +2,128 @@
 
 #include <vector>
 #include <string>
+#include <functional>
 
 #include "HMM.h"
+#include "Sequence.h"
+#include "ThreadPool.h"
+#include "FastaReader.h"
 
 using namespace std;
 
-void train_by_baumwelch(HMM& model, vector<string> observations);
+/*
+ * Every iteration returns the log-likelihood of the observations under the
+ * model it started from, summed from the scales of the E-step.
+ */
+
+/**
+ * One iteration of Baum-Welch training. A memoryBudget in bytes other than 0
+ * runs forward-backward checkpointed, see forward_backward_blocks().
+ */
+double train_by_baumwelch(HMM& model, const vector<Sequence>& observations, size_t memoryBudget = 0);
+
+/**
+ * Symbols run on either side of a segment of a long observation, so that
+ * forward-backward forgets where it was cut before reaching the segment.
+ */
+const size_t SEGMENT_BURN_IN = 10000;
+
+/**
+ * Baum-Welch iteration with the E-step spread over the threads of pool.
+ * The result only depends on the observations and the number of threads.
+ *
+ * With a segmentLength other than 0, observations of at least twice that
+ * length are cut into segments of about that length that run in parallel
+ * too. Each runs forward-backward with burnIn extra symbols on either side
+ * and counts its own windows only, so the counts are those of the whole
+ * observation up to the few windows across a cut, as long as the state
+ * distribution is forgotten within burnIn symbols.
+ */
+double train_by_baumwelch(HMM& model, const vector<Sequence>& observations, ThreadPool& pool, size_t memoryBudget = 0,
+                          size_t segmentLength = 0, size_t burnIn = SEGMENT_BURN_IN);
+
+/**
+ * Baum-Welch iteration streaming the observations from a packing reader,
+ * so only the chunks being worked on are held in memory. Only the first
+ * chunk of a record counts towards the start probs, and the others run
+ * from interior_model(), so records are counted as a whole but for the
+ * windows across a cut. As the reader is used up, every iteration needs a
+ * new one.
+ */
+double train_by_baumwelch(HMM& model, FastaReader& observations, ThreadPool& pool, size_t memoryBudget = 0);
+double train_by_baumwelch(HMM& model, vector<string> observations);
+
+/**
+ * When train_until_converged() stops, and what it does along the way.
+ */
+struct BaumWelchOptions
+{
+    size_t maxIterations = 100;
+    
+    // Stop once an iteration improves the log-likelihood by less than this
+    // fraction of its magnitude
+    double minRelativeImprovement = 1e-6;
+    
+    // Stop once no probability of the model moves by more than this
+    double minParameterDelta = 0;
+    
+    size_t memoryBudget = 0;
+    
+    // See train_by_baumwelch()
+    size_t segmentLength = 0;
+    size_t burnIn = SEGMENT_BURN_IN;
+    
+    // Back the tables kept from one iteration to the next by transparent
+    // huge pages, see DPWorkspace
+    bool hugePages = false;
+    
+    // Called with the iteration and the finalized model after every
+    // sideWorkInterval iterations and after the last one, e.g. to predict
+    // or to dump the model. An interval of 0 only runs it at the end.
+    function<void(size_t, const HMM&)> sideWork;
+    size_t sideWorkInterval = 0;
+    
+    // Called with the iteration and its log-likelihood
+    function<void(size_t, double)> progress;
+};
+
+/**
+ * Run Baum-Welch iterations on the threads of pool until the model stops
+ * improving. Returns the log-likelihood before every iteration. The model
+ * is left unlocked, as after train_by_baumwelch().
+ */
+vector<double> train_until_converged(HMM& model, const vector<Sequence>& observations, ThreadPool& pool,
+                                     const BaumWelchOptions& options = BaumWelchOptions());
+
+/**
+ * Mini-batches and step sizes of train_by_online_em().
+ */
+struct OnlineEMOptions
+{
+    // Symbols per mini-batch, at least
+    size_t batchLength = size_t(1) << 20;
+    
+    // Batch t gets the weight ((1 + stepOffset) / (t + stepOffset))^stepDecay.
+    // A decay in (0.5, 1] makes the statistics converge, and a larger
+    // offset slows down the early steps.
+    double stepDecay = 0.6;
+    double stepOffset = 2;
+    
+    size_t memoryBudget = 0;
+    bool hugePages = false;
+    
+    // Called with the batch number and the log-likelihood per symbol of the
+    // batch under the model before it
+    function<void(size_t, double)> progress;
+};
+
+/**
+ * Online EM: the expected counts of every mini-batch of chunks from a
+ * packing reader are blended into running statistics, and the model is
+ * updated from them after every batch. A pass over a large corpus thus
+ * makes many updates, and only one batch is held in memory at a time.
+ * Chunks of a record are counted like train_by_baumwelch() does. Returns
+ * the number of batches. The model is left unlocked.
+ */
+size_t train_by_online_em(HMM& model, FastaReader& observations, ThreadPool& pool,
+                          const OnlineEMOptions& options = OnlineEMOptions());
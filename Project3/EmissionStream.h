@@ -0,0 +1,164 @@
+#pragma once
+
+#include <vector>
+#include <limits>
+#include <cstdint>
+
+#include "HMM.h"
+#include "Sequence.h"
+
+using namespace std;
+
+/**
+ * Walks a sequence and keeps, for every emission arity used by the model,
+ * the code of the k-mer ending at the current position. Emission lookups
+ * are plain table reads, so decoders never build observation strings.
+ */
+class EmissionStream
+{
+public:
+    EmissionStream(const HMM& model, const Sequence& obs)
+        : model(model), obs(obs), arities(model.emissionArities()),
+          codes(arities.size(), 0), wildcards(arities.size(), 0)
+    {
+        if (!model.isFinalized())
+            throw invalid_argument("Model should be finalized!");
+        
+        seek(0);
+    }
+    
+    size_t position() const { return pos; }
+    
+    /**
+     * Move to position l.
+     */
+    void seek(size_t l) {
+        pos = l;
+        for (size_t a = 0; a < arities.size(); a++) {
+            const size_t d = arities[a];
+            if (l + 1 >= d) {
+                codes[a] = obs.kmer(l + 1 - d, d);
+                wildcards[a] = obs.ambiguityMask(l + 1 - d, d);
+            } else {
+                // Partial window, aligned so that advance() completes it
+                codes[a] = obs.kmer(0, l + 1) << (2 * (d - l - 1));
+                wildcards[a] = obs.ambiguityMask(0, l + 1) << (d - l - 1);
+            }
+        }
+    }
+    
+    /**
+     * Move to the next position by shifting in a single symbol.
+     */
+    inline void advance() {
+        pos++;
+        const uint64_t symbol = obs[pos];
+        const uint64_t ambiguous = obs.isAmbiguous(pos);
+        for (size_t a = 0; a < arities.size(); a++) {
+            const size_t d = arities[a];
+            codes[a] = (codes[a] >> 2) | (symbol << (2 * (d - 1)));
+            wildcards[a] = (wildcards[a] >> 1) | (ambiguous << (d - 1));
+        }
+    }
+    
+    /**
+     * Code of the k-mer of the given arity (index into emissionArities())
+     * ending at the current position.
+     */
+    inline uint64_t code(size_t arityIndex) const {
+        return codes[arityIndex];
+    }
+    
+    /**
+     * Probability that state emits the symbols ending at the current position.
+     */
+    inline double prob(size_t state) const {
+        const size_t a = model.arityIndex(state);
+        if (pos + 1 < arities[a])
+            return 0;
+        return model.emissionTable(state).prob(codes[a], wildcards[a]);
+    }
+    
+    inline double logProb(size_t state) const {
+        const size_t a = model.arityIndex(state);
+        if (pos + 1 < arities[a])
+            return -numeric_limits<double>::infinity();
+        return model.emissionTable(state).logProb(codes[a], wildcards[a]);
+    }
+    
+    /**
+     * Probability that state emits the symbols ending at position l,
+     * without moving the stream.
+     */
+    inline double probAt(size_t state, size_t l) const {
+        const size_t d = model.stateArity(state);
+        if (l + 1 < d || l >= obs.length())
+            return 0;
+        return model.emissionTable(state).prob(obs.kmer(l + 1 - d, d), obs.ambiguityMask(l + 1 - d, d));
+    }
+    
+    inline double logProbAt(size_t state, size_t l) const {
+        const size_t d = model.stateArity(state);
+        if (l + 1 < d || l >= obs.length())
+            return -numeric_limits<double>::infinity();
+        return model.emissionTable(state).logProb(obs.kmer(l + 1 - d, d), obs.ambiguityMask(l + 1 - d, d));
+    }
+    
+private:
+    const HMM& model;
+    const Sequence& obs;
+    const vector<size_t>& arities;
+    
+    size_t pos;
+    vector<uint64_t> codes, wildcards;
+};
+
+/**
+ * The k-mer codes of an EmissionStream for symbols that arrive one at a
+ * time, e.g. from the chunks of a sequence that is streamed through.
+ */
+class RollingEmissions
+{
+public:
+    RollingEmissions(const HMM& model)
+        : model(model), arities(model.emissionArities()), count(0),
+          codes(arities.size(), 0), wildcards(arities.size(), 0)
+    {
+        if (!model.isFinalized())
+            throw invalid_argument("Model should be finalized!");
+    }
+    
+    /**
+     * Number of symbols pushed so far.
+     */
+    size_t length() const { return count; }
+    
+    /**
+     * Shift in the next symbol, given by its code and whether it is ambiguous.
+     */
+    inline void push(uint64_t symbol, uint64_t ambiguous) {
+        count++;
+        for (size_t a = 0; a < arities.size(); a++) {
+            const size_t d = arities[a];
+            codes[a] = (codes[a] >> 2) | (symbol << (2 * (d - 1)));
+            wildcards[a] = (wildcards[a] >> 1) | (ambiguous << (d - 1));
+        }
+    }
+    
+    /**
+     * Probability that state emits the symbols ending with the last one pushed.
+     */
+    inline double prob(size_t state) const {
+        const size_t a = model.arityIndex(state);
+        if (count < arities[a])
+            return 0;
+        return model.emissionTable(state).prob(codes[a], wildcards[a]);
+    }
+    
+private:
+    const HMM& model;
+    const vector<size_t>& arities;
+    
+    size_t count;
+    vector<uint64_t> codes, wildcards;
+};
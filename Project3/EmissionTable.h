@@ -0,0 +1,125 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#include "AlignedAllocator.h"
+#include "Sequence.h"
+
+using namespace std;
+
+/**
+ * The emission probabilities of a single state, indexed by k-mer code and
+ * kept in both linear and log space. States of arity up to MAX_DENSE_ARITY
+ * get a dense table; larger arities fall back to a sorted list of the
+ * non-zero entries.
+ */
+class EmissionTable
+{
+public:
+    EmissionTable() : d(0), dense(true) { }
+    
+    EmissionTable(size_t d, const unordered_map<string, double>& emissions)
+        : d(d), dense(d <= MAX_DENSE_ARITY)
+    {
+        if (dense) {
+            probs = aligned_vector<double>(size_t(1) << (2*d), 0);
+            for (auto emission : emissions)
+                probs[Sequence::kmerCode(emission.first)] = emission.second;
+            
+            logProbs = aligned_vector<double>(probs.size(), 0);
+            for (size_t i = 0; i < probs.size(); i++)
+                logProbs[i] = log(probs[i]);
+        } else {
+            for (auto emission : emissions)
+                sparse.push_back(make_pair(Sequence::kmerCode(emission.first), emission.second));
+            sort(sparse.begin(), sparse.end());
+        }
+    }
+    
+    /**
+     * A table from the probs of all 4^d k-mers by code, or from the
+     * (code, prob) pairs of the non-zero ones sorted by code if d is above
+     * MAX_DENSE_ARITY.
+     */
+    EmissionTable(size_t d, const double* table, vector<pair<uint64_t, double>> entries)
+        : d(d), dense(d <= MAX_DENSE_ARITY), sparse(move(entries))
+    {
+        if (dense) {
+            probs = aligned_vector<double>(table, table + (size_t(1) << (2*d)));
+            
+            logProbs = aligned_vector<double>(probs.size(), 0);
+            for (size_t i = 0; i < probs.size(); i++)
+                logProbs[i] = log(probs[i]);
+        }
+    }
+    
+    size_t emissionArity() const { return d; }
+    
+    bool isDense() const { return dense; }
+    
+    inline double prob(uint64_t code) const {
+        if (dense)
+            return probs[code];
+        
+        auto it = lower_bound(sparse.begin(), sparse.end(), make_pair(code, 0.));
+        return it != sparse.end() && it->first == code ? it->second : 0;
+    }
+    
+    inline double logProb(uint64_t code) const {
+        return dense ? logProbs[code] : log(prob(code));
+    }
+    
+    /**
+     * Call visit(code, prob) for every prob other than 0, by code.
+     */
+    template<class Visit>
+    void forEach(Visit visit) const {
+        if (!dense) {
+            for (auto entry : sparse)
+                visit(entry.first, entry.second);
+            return;
+        }
+        for (uint64_t code = 0; code < probs.size(); code++) {
+            if (probs[code] != 0)
+                visit(code, probs[code]);
+        }
+    }
+    
+    /**
+     * Emission prob where the symbols flagged in wildcards are unknown and
+     * summed out.
+     */
+    double prob(uint64_t code, uint64_t wildcards) const {
+        if (wildcards == 0)
+            return prob(code);
+        
+        size_t i = 0;
+        while (((wildcards >> i) & 1) == 0)
+            i++;
+        
+        const uint64_t rest = wildcards & ~(uint64_t(1) << i);
+        const uint64_t cleared = code & ~(uint64_t(3) << (2*i));
+        double res = 0;
+        for (uint64_t c = 0; c < 4; c++)
+            res += prob(cleared | (c << (2*i)), rest);
+        return res;
+    }
+    
+    double logProb(uint64_t code, uint64_t wildcards) const {
+        return wildcards == 0 ? logProb(code) : log(prob(code, wildcards));
+    }
+    
+    constexpr static const size_t MAX_DENSE_ARITY = 10;
+
+private:
+    size_t d;
+    bool dense;
+    
+    aligned_vector<double> probs, logProbs;
+    vector<pair<uint64_t, double>> sparse;
+};
@@ -1,49 +1,149 @@
 #include <vector>
 #include <string>
 #include <fstream>
+#include <iterator>
 #include <stdexcept>
+#include <cstring>
 
 #include "Fasta.h"
+#include "MappedFile.h"
+#include "Compression.h"
 
 using namespace std;
 
-vector<pair<string,string>> read_fasta_from_stream(ifstream& stream)
+string FastaRecord::sequence() const
 {
-    vector<pair<string,string>> seqs;
-    string seq, line, name;
-    while (getline(stream, line)) {
-        if (!line.empty() && line[0] == '>') {
-            if (!seq.empty()) {
-                seqs.push_back(make_pair(name, seq));
-                seq = "";
-            }
-            name = line.substr(1);
-        } else if (!line.empty() && line[0] == ';') {
-            // Ignore the line...
-        } else {
-            for (unsigned int i = 0; i < line.length(); i++) {
-                if (line[i] != ' ')
-                    seq += line[i];
-            }
+    string seq;
+    seq.reserve(bodyLength);
+    forEachRun([&seq] (const char* symbols, size_t n) { seq.append(symbols, n); });
+    return seq;
+}
+
+vector<FastaRecord> fasta_records(const char* data, size_t size)
+{
+    vector<FastaRecord> records;
+    const char* end = data + size;
+    const char* header = data;
+    size_t headerLength = 0;
+    const char* body = data;
+    bool hasSymbols = false;
+    
+    for (const char* p = data; p < end;) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        if (lineEnd == nullptr)
+            lineEnd = end;
+        
+        if (*p == '>') {
+            if (hasSymbols)
+                records.push_back(FastaRecord(header, headerLength, body, p - body));
+            
+            header = p + 1;
+            headerLength = lineEnd - header;
+            if (headerLength > 0 && header[headerLength - 1] == '\r')
+                headerLength--;
+            body = lineEnd < end ? lineEnd + 1 : end;
+            hasSymbols = false;
+        } else if (*p != ';') {
+            for (const char* q = p; q < lineEnd && !hasSymbols; q++)
+                hasSymbols = !FastaRecord::isBlank(*q);
         }
+        p = lineEnd + 1;
     }
-    seqs.push_back(make_pair(name, seq));
+    records.push_back(FastaRecord(header, headerLength, body, end - body));
+    
+    return records;
+}
+
+vector<pair<string,string>> read_fasta_from_stream(ifstream& stream)
+{
+    const string data((istreambuf_iterator<char>(stream)), istreambuf_iterator<char>());
+    
+    vector<pair<string,string>> seqs;
+    for (auto& record : fasta_records(data.data(), data.size()))
+        seqs.push_back(make_pair(record.name(), record.sequence()));
     return seqs;
 }
 
-vector<string> read_seqs_from_files(vector<string> files)
+static bool scan_fasta(const MappedFile& mapped, ThreadPool* pool, function<bool(const string&)> header,
+                       function<bool(const char*, size_t)> symbols)
+{
+    FastaScanner scanner;
+    return decompress(mapped.data(), mapped.size(), pool, [&scanner, &header, &symbols] (const char* data, size_t n) {
+        return scanner.feed(data, n, header, symbols);
+    }) && scanner.finish(header);
+}
+
+bool scan_fasta_file(const string& file, ThreadPool* pool, function<bool(const string&)> header,
+                     function<bool(const char*, size_t)> symbols)
+{
+    MappedFile mapped(file);
+    return scan_fasta(mapped, pool, header, symbols);
+}
+
+/**
+ * Read the records of a compressed file like read_fasta_from_stream(),
+ * calling start() for every record kept and symbols(run, n) for its symbols.
+ */
+template<class Start, class Symbols>
+static void scan_compressed_records(const MappedFile& mapped, ThreadPool* pool, Start start, Symbols symbols)
+{
+    // A record without symbols is replaced by the next one
+    bool started = false, hasSymbols = false;
+    auto header = [&] (const string&) {
+        if (hasSymbols || !started)
+            start();
+        started = true;
+        hasSymbols = false;
+        return true;
+    };
+    
+    scan_fasta(mapped, pool, header, [&] (const char* run, size_t n) {
+        if (!started) {
+            start();
+            started = true;
+        }
+        hasSymbols = true;
+        symbols(run, n);
+        return true;
+    });
+    if (!started)
+        start();
+}
+
+vector<string> read_seqs_from_files(vector<string> files, ThreadPool* pool)
 {
     vector<string> seqs;
     for (string file : files) {
-        ifstream stream(file);
-        if (!stream.is_open())
-            throw runtime_error("Could not find " + file);
+        MappedFile mapped(file);
+        if (detect_compression(mapped.data(), mapped.size()) != Compression::None) {
+            scan_compressed_records(mapped, pool, [&seqs] () { seqs.push_back(string()); },
+                                      [&seqs] (const char* run, size_t n) { seqs.back().append(run, n); });
+            continue;
+        }
         
-        auto seqsInFile = read_fasta_from_stream(stream);
-        for (auto seqdesc : seqsInFile)
-            seqs.push_back(seqdesc.second);
+        for (auto& record : fasta_records(mapped.data(), mapped.size()))
+            seqs.push_back(record.sequence());
+    }
+    return seqs;
+}
+
+vector<Sequence> read_packed_seqs_from_files(vector<string> files, ThreadPool* pool)
+{
+    vector<Sequence> seqs;
+    for (string file : files) {
+        MappedFile mapped(file);
+        if (detect_compression(mapped.data(), mapped.size()) != Compression::None) {
+            scan_compressed_records(mapped, pool, [&seqs] () { seqs.push_back(Sequence()); },
+                                      [&seqs] (const char* run, size_t n) { seqs.back().append(run, n); });
+            continue;
+        }
         
-        stream.close();
+        // Symbols are packed straight from the mapped file
+        for (auto& record : fasta_records(mapped.data(), mapped.size())) {
+            seqs.push_back(Sequence());
+            seqs.back().reserve(record.rawLength());
+            record.forEachRun([&seqs] (const char* symbols, size_t n) { seqs.back().append(symbols, n); });
+        }
     }
     return seqs;
 }
@@ -3,8 +3,172 @@
 #include <vector>
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <functional>
+
+#include "Sequence.h"
 
 using namespace std;
 
+class ThreadPool;
+
+/**
+ * A record of a FASTA file held in memory, pointing into the file data.
+ * The sequence may span several lines and is read with forEachRun().
+ */
+class FastaRecord
+{
+public:
+    FastaRecord(const char* header, size_t headerLength, const char* body, size_t bodyLength)
+        : header(header), headerLength(headerLength), body(body), bodyLength(bodyLength)
+    { }
+    
+    string name() const { return string(header, headerLength); }
+    
+    /**
+     * Bytes the sequence spans in the file, an upper bound on its length.
+     */
+    size_t rawLength() const { return bodyLength; }
+    
+    /**
+     * Call visit(symbols, n) for every run of symbols of the sequence in
+     * order, skipping line breaks, blanks and comment lines.
+     */
+    template<class Visit>
+    void forEachRun(Visit visit) const {
+        const char* p = body;
+        const char* end = body + bodyLength;
+        while (p < end) {
+            const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+            if (lineEnd == nullptr)
+                lineEnd = end;
+            
+            if (*p != ';') {
+                const char* run = p;
+                for (const char* q = p; q < lineEnd; q++) {
+                    if (isBlank(*q)) {
+                        if (q > run)
+                            visit(run, size_t(q - run));
+                        run = q + 1;
+                    }
+                }
+                if (lineEnd > run)
+                    visit(run, size_t(lineEnd - run));
+            }
+            p = lineEnd + 1;
+        }
+    }
+    
+    string sequence() const;
+    
+    static inline bool isBlank(char c) {
+        return c == ' ' || c == '\r' || c == '\t';
+    }
+
+private:
+    const char* header;
+    size_t headerLength;
+    const char* body;
+    size_t bodyLength;
+};
+
+/**
+ * Splits FASTA data handed over in pieces of any size, such as the output
+ * of a decompressor, into record names and runs of symbols. The state of
+ * a line cut between pieces is carried over.
+ */
+class FastaScanner
+{
+public:
+    FastaScanner() : atLineStart(true), inHeader(false), inComment(false) { }
+    
+    /**
+     * Scan the next piece, calling header(name) once a header line is
+     * complete and symbols(run, n) for every run of symbols as with
+     * FastaRecord::forEachRun(). Returns false as soon as either does.
+     */
+    template<class Header, class Symbols>
+    bool feed(const char* data, size_t size, Header header, Symbols symbols) {
+        const char* end = data + size;
+        for (const char* p = data; p < end;) {
+            if (atLineStart) {
+                atLineStart = false;
+                if (*p == '>') {
+                    inHeader = true;
+                    name.clear();
+                    p++;
+                    continue;
+                }
+                inComment = *p == ';';
+            }
+            
+            const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+            const char* stop = lineEnd != nullptr ? lineEnd : end;
+            
+            if (inHeader) {
+                name.append(p, stop - p);
+            } else if (!inComment) {
+                const char* run = p;
+                for (const char* q = p; q < stop; q++) {
+                    if (FastaRecord::isBlank(*q)) {
+                        if (q > run && !symbols(run, size_t(q - run)))
+                            return false;
+                        run = q + 1;
+                    }
+                }
+                if (stop > run && !symbols(run, size_t(stop - run)))
+                    return false;
+            }
+            
+            if (lineEnd == nullptr)
+                break;
+            atLineStart = true;
+            p = lineEnd + 1;
+            if (inHeader && !finishHeader(header))
+                return false;
+        }
+        return true;
+    }
+    
+    /**
+     * End of data, completing a last header line without line break.
+     */
+    template<class Header>
+    bool finish(Header header) {
+        return !inHeader || finishHeader(header);
+    }
+
+private:
+    template<class Header>
+    bool finishHeader(Header header) {
+        inHeader = false;
+        if (!name.empty() && name.back() == '\r')
+            name.pop_back();
+        return header(name);
+    }
+    
+    bool atLineStart, inHeader, inComment;
+    string name;
+};
+
+/**
+ * Scan a FASTA file with a FastaScanner, decompressing it on the fly if it
+ * is gzip or BGZF. BGZF blocks are decompressed on pool unless it is null.
+ * Returns false if stopped by header or symbols.
+ */
+bool scan_fasta_file(const string& file, ThreadPool* pool, function<bool(const string&)> header,
+                     function<bool(const char*, size_t)> symbols);
+
+/**
+ * The records of FASTA data in memory. Like read_fasta_from_stream(), a
+ * record without symbols is dropped unless it is the last one.
+ */
+vector<FastaRecord> fasta_records(const char* data, size_t size);
+
 vector<pair<string,string>> read_fasta_from_stream(ifstream& stream);
-vector<string> read_seqs_from_files(vector<string> files);
+
+/*
+ * Compressed files are read through scan_fasta_file() with the given pool.
+ */
+vector<string> read_seqs_from_files(vector<string> files, ThreadPool* pool = nullptr);
+vector<Sequence> read_packed_seqs_from_files(vector<string> files, ThreadPool* pool = nullptr);
@@ -0,0 +1,240 @@
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
+
+#include <sys/stat.h>
+
+#include "FastaIndex.h"
+#include "Compression.h"
+
+using namespace std;
+
+void FastaIndex::add(const FaiEntry& entry)
+{
+    if (contains(entry.name))
+        throw runtime_error("Duplicate sequence name " + entry.name + "!");
+    byName[entry.name] = records.size();
+    records.push_back(entry);
+}
+
+FastaIndex FastaIndex::build(const char* data, size_t size)
+{
+    FastaIndex index;
+    const char* end = data + size;
+    
+    FaiEntry entry;
+    bool inRecord = false, shortLine = false;
+    for (const char* p = data; p < end;) {
+        const char* lineEnd = static_cast<const char*>(memchr(p, '\n', end - p));
+        const char* next = lineEnd != nullptr ? lineEnd + 1 : end;
+        size_t bases = (lineEnd != nullptr ? lineEnd : end) - p;
+        if (bases > 0 && p[bases - 1] == '\r')
+            bases--;
+        
+        if (*p == '>') {
+            if (inRecord)
+                index.add(entry);
+            
+            const char* name = p + 1;
+            const char* nameEnd = name;
+            while (nameEnd < p + bases && !isspace(*nameEnd))
+                nameEnd++;
+            
+            entry = FaiEntry{ string(name, nameEnd), 0, size_t(next - data), 0, 0 };
+            inRecord = true;
+            shortLine = false;
+        } else if (*p == ';') {
+            // Comments may come before the sequence, but would break the
+            // line arithmetic within it
+            if (inRecord && entry.lineBases > 0)
+                shortLine = true;
+        } else if (bases > 0) {
+            if (!inRecord)
+                throw runtime_error("Cannot index symbols before the first header!");
+            if (shortLine || (entry.lineBases > 0 && bases > entry.lineBases))
+                throw runtime_error("Cannot index " + entry.name + ": lines of different length!");
+            
+            // The sequence starts at its first line of symbols, after any
+            // blank or comment lines
+            if (entry.lineBases == 0) {
+                entry.offset = p - data;
+                entry.lineBases = bases;
+                entry.lineBytes = next - p;
+            }
+            shortLine = bases < entry.lineBases || size_t(next - p) != entry.lineBytes;
+            entry.length += bases;
+        } else if (inRecord && entry.lineBases > 0) {
+            // Only blank lines may follow the end of a sequence
+            shortLine = true;
+        }
+        p = next;
+    }
+    if (inRecord)
+        index.add(entry);
+    
+    return index;
+}
+
+FastaIndex FastaIndex::load(const string& file)
+{
+    ifstream input(file);
+    if (!input)
+        throw runtime_error("Could not find " + file);
+    
+    FastaIndex index;
+    string line;
+    while (getline(input, line)) {
+        if (line.empty())
+            continue;
+        
+        stringstream fields(line);
+        FaiEntry entry;
+        if (!getline(fields, entry.name, '\t') || !(fields >> entry.length >> entry.offset >> entry.lineBases >> entry.lineBytes))
+            throw runtime_error("Illegal line in " + file + "!");
+        index.add(entry);
+    }
+    return index;
+}
+
+void FastaIndex::save(const string& file) const
+{
+    ofstream output(file);
+    if (!output)
+        throw runtime_error("Could not write " + file);
+    
+    for (const FaiEntry& entry : records) {
+        output << entry.name << '\t' << entry.length << '\t' << entry.offset << '\t'
+               << entry.lineBases << '\t' << entry.lineBytes << '\n';
+    }
+}
+
+const FaiEntry& FastaIndex::entry(const string& name) const
+{
+    auto it = byName.find(name);
+    if (it == byName.end())
+        throw invalid_argument("Unknown sequence " + name + "!");
+    return records[it->second];
+}
+
+bool FastaIndex::fits(size_t size) const
+{
+    for (const FaiEntry& entry : records) {
+        if (entry.length == 0)
+            continue;
+        const size_t last = entry.length - 1;
+        if (entry.lineBases == 0 || entry.offset + last / entry.lineBases * entry.lineBytes + last % entry.lineBases >= size)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Parse a 1-based position, skipping commas.
+ */
+static bool parse_position(const string& text, size_t& position)
+{
+    string digits;
+    for (char c : text) {
+        if (c == ',')
+            continue;
+        if (!isdigit(c))
+            return false;
+        digits += c;
+    }
+    if (digits.empty())
+        return false;
+    
+    position = strtoull(digits.c_str(), nullptr, 10);
+    return position > 0;
+}
+
+FastaRegion FastaIndex::region(const string& spec) const
+{
+    // Names may contain colons themselves
+    if (contains(spec))
+        return FastaRegion{ spec, 0, entry(spec).length };
+    
+    const size_t colon = spec.rfind(':');
+    if (colon == string::npos)
+        throw invalid_argument("Unknown sequence " + spec + "!");
+    
+    const FaiEntry& record = entry(spec.substr(0, colon));
+    const string range = spec.substr(colon + 1);
+    const size_t dash = range.find('-');
+    
+    size_t start, end = record.length;
+    if (!parse_position(range.substr(0, dash), start)
+        || (dash != string::npos && !parse_position(range.substr(dash + 1), end)) || end < start)
+        throw invalid_argument("Invalid region " + spec + "!");
+    
+    return FastaRegion{ record.name, min(start - 1, record.length), min(end, record.length) };
+}
+
+IndexedFasta::IndexedFasta(const string& file) : mapped(file, false)
+{
+    if (detect_compression(mapped.data(), mapped.size()) != Compression::None)
+        throw runtime_error("Cannot index compressed file " + file + "!");
+    
+    // An index older than the file, or one that does not fit it, is stale
+    // and would fetch the wrong symbols, so it is built again
+    struct stat info, indexInfo;
+    const string indexFile = file + ".fai";
+    if (stat(indexFile.c_str(), &indexInfo) == 0 && stat(file.c_str(), &info) == 0
+        && indexInfo.st_mtime >= info.st_mtime) {
+        try {
+            fai = FastaIndex::load(indexFile);
+            if (fai.fits(mapped.size()))
+                return;
+        } catch (runtime_error&) { }
+    }
+    
+    fai = FastaIndex::build(mapped.data(), mapped.size());
+    
+    // The index only saves work later, so a read-only directory is fine
+    try {
+        fai.save(indexFile);
+    } catch (runtime_error&) { }
+}
+
+template<class Visit>
+void IndexedFasta::forEachRun(const FastaRegion& region, Visit visit) const
+{
+    const FaiEntry& entry = fai.entry(region.name);
+    if (region.end > entry.length || region.begin > region.end)
+        throw invalid_argument("Region outside of " + region.name + "!");
+    if (region.begin == region.end)
+        return;
+    
+    size_t line = region.begin / entry.lineBases, column = region.begin % entry.lineBases;
+    for (size_t pos = region.begin; pos < region.end; line++, column = 0) {
+        const size_t n = min(entry.lineBases - column, region.end - pos);
+        const size_t offset = entry.offset + line * entry.lineBytes + column;
+        if (offset + n > mapped.size())
+            throw runtime_error("Index does not match the file of " + region.name + "!");
+        
+        visit(mapped.data() + offset, n);
+        pos += n;
+    }
+}
+
+Sequence IndexedFasta::fetch(const FastaRegion& region) const
+{
+    Sequence seq;
+    seq.reserve(region.end - region.begin);
+    forEachRun(region, [&seq] (const char* symbols, size_t n) { seq.append(symbols, n); });
+    return seq;
+}
+
+string IndexedFasta::fetchSymbols(const FastaRegion& region) const
+{
+    string seq;
+    seq.reserve(region.end - region.begin);
+    forEachRun(region, [&seq] (const char* symbols, size_t n) { seq.append(symbols, n); });
+    return seq;
+}
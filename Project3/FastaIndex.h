@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+
+#include "Sequence.h"
+#include "MappedFile.h"
+
+using namespace std;
+
+/**
+ * A record of a FASTA index, as in the .fai files of samtools faidx: the
+ * sequence starts offset bytes into the file, and every line but the last
+ * holds lineBases symbols in lineBytes bytes.
+ */
+struct FaiEntry
+{
+    string name;
+    size_t length, offset, lineBases, lineBytes;
+};
+
+/**
+ * The symbols [begin, end) of the sequence called name.
+ */
+struct FastaRegion
+{
+    string name;
+    size_t begin, end;
+};
+
+/**
+ * The index of a FASTA file. Records are named by the first word of their
+ * header, and their lines must all be of the same length but the last.
+ */
+class FastaIndex
+{
+public:
+    static FastaIndex build(const char* data, size_t size);
+    static FastaIndex load(const string& file);
+    void save(const string& file) const;
+    
+    const vector<FaiEntry>& entries() const { return records; }
+    
+    bool contains(const string& name) const { return byName.count(name) > 0; }
+    const FaiEntry& entry(const string& name) const;
+    
+    /**
+     * Whether every sequence ends within a file of size bytes.
+     */
+    bool fits(size_t size) const;
+    
+    /**
+     * Parse a region given as name, name:start or name:start-end, with
+     * 1-based, inclusive positions that may contain commas. The end is cut
+     * at the end of the sequence.
+     */
+    FastaRegion region(const string& spec) const;
+
+private:
+    void add(const FaiEntry& entry);
+    
+    vector<FaiEntry> records;
+    unordered_map<string,size_t> byName;
+};
+
+/**
+ * A FASTA file mapped into memory with its index, for reading regions
+ * without loading the file.
+ */
+class IndexedFasta
+{
+public:
+    /**
+     * Open file with the index file + ".fai", which is built and saved
+     * first if it does not exist, or is older than file or does not fit it.
+     * Compressed files cannot be indexed.
+     */
+    explicit IndexedFasta(const string& file);
+    
+    const FastaIndex& index() const { return fai; }
+    
+    Sequence fetch(const FastaRegion& region) const;
+    string fetchSymbols(const FastaRegion& region) const;
+    
+    Sequence fetch(const string& region) const { return fetch(fai.region(region)); }
+    string fetchSymbols(const string& region) const { return fetchSymbols(fai.region(region)); }
+
+private:
+    /**
+     * Call visit(symbols, n) for every line of the region in order.
+     */
+    template<class Visit>
+    void forEachRun(const FastaRegion& region, Visit visit) const;
+    
+    MappedFile mapped;
+    FastaIndex fai;
+};
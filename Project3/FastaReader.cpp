@@ -0,0 +1,137 @@
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "FastaReader.h"
+#include "Fasta.h"
+
+using namespace std;
+
+FastaReader::FastaReader(vector<string> files, bool pack, size_t chunkLength, size_t readAhead, ThreadPool* pool)
+    : files(files), pack(pack), chunkLength(chunkLength), readAhead(max<size_t>(readAhead, 1)), pool(pool),
+      done(false), stopping(false)
+{
+    reader = thread(&FastaReader::read, this);
+}
+
+FastaReader::~FastaReader()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+    space.notify_all();
+    reader.join();
+}
+
+bool FastaReader::next(FastaChunk& chunk)
+{
+    unique_lock<mutex> guard(lock);
+    available.wait(guard, [this] () { return done || !chunks.empty(); });
+    
+    if (chunks.empty()) {
+        if (error) {
+            exception_ptr thrown = error;
+            error = nullptr;
+            rethrow_exception(thrown);
+        }
+        return false;
+    }
+    
+    chunk = move(chunks.front());
+    chunks.pop();
+    guard.unlock();
+    space.notify_one();
+    return true;
+}
+
+void FastaReader::read()
+{
+    try {
+        for (const string& file : files)
+            readFile(file);
+    } catch (...) {
+        unique_lock<mutex> guard(lock);
+        error = current_exception();
+    }
+    
+    {
+        unique_lock<mutex> guard(lock);
+        done = true;
+    }
+    available.notify_all();
+}
+
+bool FastaReader::push(FastaChunk& chunk)
+{
+    {
+        unique_lock<mutex> guard(lock);
+        space.wait(guard, [this] () { return stopping || chunks.size() < readAhead; });
+        if (stopping)
+            return false;
+        chunks.push(move(chunk));
+    }
+    available.notify_one();
+    return true;
+}
+
+void FastaReader::readFile(const string& file)
+{
+    FastaChunk chunk;
+    size_t length = 0;
+    bool hasSymbols = false;
+    
+    // A full chunk is only handed out once more symbols follow, so the
+    // last chunk of a record is never empty
+    auto flush = [&] (bool endsRecord) {
+        const string name = chunk.name;
+        const size_t offset = chunk.offset + length;
+        
+        chunk.endsRecord = endsRecord;
+        if (!push(chunk))
+            return false;
+        
+        chunk = FastaChunk();
+        chunk.name = name;
+        chunk.offset = endsRecord ? 0 : offset;
+        length = 0;
+        return true;
+    };
+    
+    auto append = [&] (const char* symbols, size_t n) {
+        while (n > 0) {
+            if (chunkLength > 0 && length == chunkLength && !flush(false))
+                return false;
+            
+            const size_t take = chunkLength > 0 ? min(n, chunkLength - length) : n;
+            if (pack)
+                chunk.sequence.append(symbols, take);
+            else
+                chunk.symbols.append(symbols, take);
+            
+            symbols += take;
+            n -= take;
+            length += take;
+            hasSymbols = true;
+        }
+        return true;
+    };
+    
+    auto header = [&] (const string& name) {
+        if (hasSymbols && !flush(true))
+            return false;
+        
+        // A record without symbols is dropped
+        chunk = FastaChunk();
+        chunk.name = name;
+        length = 0;
+        hasSymbols = false;
+        return true;
+    };
+    
+    if (!scan_fasta_file(file, pool, header, append))
+        return;
+    
+    // The last record of a file is kept even without symbols
+    flush(true);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <queue>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "Sequence.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+/**
+ * A record of a FASTA file, or a piece of one when records are chunked.
+ */
+struct FastaChunk
+{
+    string name;
+    
+    // Position of the chunk in its record, and whether the record ends with it
+    size_t offset = 0;
+    bool endsRecord = true;
+    
+    // Filled when packing
+    Sequence sequence;
+    
+    // Filled otherwise, e.g. for annotations that are not nucleotides
+    string symbols;
+};
+
+/**
+ * Reads the records of FASTA files one at a time, so collections larger
+ * than memory can be streamed through. A background thread keeps up to
+ * readAhead chunks ready. Records are split and dropped like
+ * read_fasta_from_stream() does, and with a chunkLength other than 0
+ * they are handed out in pieces of at most that many symbols.
+ *
+ * Files compressed with gzip are decompressed as they are read, and BGZF
+ * files have their blocks decompressed on pool if one is given.
+ */
+class FastaReader
+{
+public:
+    explicit FastaReader(vector<string> files, bool pack = true, size_t chunkLength = 0, size_t readAhead = 4,
+                         ThreadPool* pool = nullptr);
+    ~FastaReader();
+    
+    FastaReader(const FastaReader&) = delete;
+    FastaReader& operator=(const FastaReader&) = delete;
+    
+    /**
+     * Move the next chunk into chunk. Returns false once every file is
+     * read. Errors of the reading thread are rethrown here.
+     */
+    bool next(FastaChunk& chunk);
+
+private:
+    void read();
+    void readFile(const string& file);
+    bool push(FastaChunk& chunk);
+    
+    const vector<string> files;
+    const bool pack;
+    const size_t chunkLength, readAhead;
+    ThreadPool* const pool;
+    
+    queue<FastaChunk> chunks;
+    bool done, stopping;
+    exception_ptr error;
+    
+    mutex lock;
+    condition_variable available, space;
+    thread reader;
+};
@@ -2,52 +2,154 @@
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <chrono>
 
 #include "ForwardBackward.h"
+#include "Checkpointing.h"
 #include "Matrix.h"
 #include "HMM.h"
+#include "EmissionStream.h"
+#include "ParallelScan.h"
 
 using namespace std;
 
-tuple<vector<double>, Matrix<double>, Matrix<double>> forward_backward(string obs, const HMM& model)
+/*
+ * The recursions are written against accessors forward(i, state),
+ * backward(i, state) and cs(i) returning references, so the full tables and
+ * the checkpointed blocks share the exact same arithmetic. Emissions may be
+ * an EmissionStream or RollingEmissions.
+ */
+
+template<class Emissions, class Forward, class Scale>
+static void forward_first_column(const HMM& model, const Emissions& emissions, Forward forward, Scale cs)
+{
+    // Calculate c1
+    cs(0) = 0;
+    for (size_t state = 0; state < model.numStates(); state++)
+        cs(0) += model.startProb(state) * emissions.prob(state);
+    // Base case
+    for (size_t state = 0; state < model.numStates(); state++)
+        forward(0, state) = model.startProb(state) * emissions.prob(state) / cs(0);
+}
+
+ForwardKernel::ForwardKernel(const HMM& model)
+    : arities(model.emissionArities()), groups(arities.size()),
+      delta(model.numStates(), 0), weights(model.numStates(), 0)
+{
+    for (size_t state = 0; state < model.numStates(); state++)
+        groups[model.arityIndex(state)].push_back(state);
+}
+
+/*
+ * A state of arity d entering at position i is divided by the d - 1 scales
+ * before i on the way forward, and by the d scales after i on the way back.
+ * Those products are taken once per position and arity, and the sums over
+ * predecessors are multiplied by them and by the emission only once.
+ */
+
+template<class Emissions, class Forward, class Scale>
+static void forward_column(const HMM& model, const Emissions& emissions, size_t i,
+                           Forward forward, Scale cs, ForwardKernel& kernel)
+{
+    vector<double>& delta = kernel.delta;
+    fill(delta.begin(), delta.end(), 0.);
+    
+    double product = 1;
+    for (size_t a = 0, k = 1; a < kernel.arities.size() && kernel.arities[a] <= i; a++) {
+        for (; k < kernel.arities[a]; k++)
+            product *= cs(i - k);
+        
+        const size_t d = kernel.arities[a];
+        const double reciprocal = 1 / product;
+        for (auto state : kernel.groups[a]) {
+            Span<const size_t> incomming = model.incommingStates(state);
+            Span<const double> probs = model.incommingProbs(state);
+            double sum = 0;
+            for (size_t j = 0; j < incomming.size(); j++)
+                sum += forward(i - d, incomming[j]) * probs[j];
+            delta[state] = sum * reciprocal * emissions.prob(state);
+        }
+    }
+    
+    cs(i) = 0;
+    for (size_t state = 0; state < model.numStates(); state++)
+        cs(i) += delta[state];
+    
+    const double reciprocal = 1 / cs(i);
+    for (size_t state = 0; state < model.numStates(); state++)
+        forward(i, state) = delta[state] * reciprocal;
+}
+
+template<class Backward, class Scale>
+static void backward_column(const HMM& model, const EmissionStream& emissions, size_t i, size_t N,
+                            Backward backward, Scale cs, ForwardKernel& kernel)
+{
+    // Everything about a successor but the transition into it
+    vector<double>& weights = kernel.weights;
+    double product = 1;
+    for (size_t a = 0, k = 1; a < kernel.arities.size(); a++) {
+        const size_t d = kernel.arities[a];
+        for (; k <= d && i + k <= N; k++)
+            product *= cs(i + k);
+        
+        const double reciprocal = 1 / product;
+        for (auto nextState : kernel.groups[a]) {
+            weights[nextState] = i + d > N ? 0
+                : backward(i + d, nextState) * emissions.probAt(nextState, i + d) * reciprocal;
+        }
+    }
+    
+    for (size_t state = 0; state < model.numStates(); state++) {
+        Span<const size_t> outgoing = model.outgoingStates(state);
+        Span<const double> probs = model.outgoingProbs(state);
+        double prob = 0;
+        for (size_t j = 0; j < outgoing.size(); j++)
+            prob += weights[outgoing[j]] * probs[j];
+        backward(i, state) = prob;
+    }
+}
+
+tuple<vector<double>, Matrix<double>, Matrix<double>> forward_backward(const Sequence& obs, const HMM& model,
+                                                                       ForwardBackwardTimings* timings)
 {
     if (!model.isFinalized())
         throw runtime_error("Model should be finalized!");
+    if (obs.length() == 0)
+        throw invalid_argument("Empty observation!");
+    
+    auto started = chrono::steady_clock::now();
+    auto lap = [&started] () {
+        auto now = chrono::steady_clock::now();
+        double seconds = chrono::duration<double>(now - started).count();
+        started = now;
+        return seconds;
+    };
+    
+    ForwardKernel kernel(model);
+    if (timings != nullptr)
+        timings->setup = lap();
     
     // Forward algorithm
     Matrix<double> forward(obs.length(), model.numStates(), 0);
     vector<double> cs(obs.length(), 0);
+    EmissionStream emissions(model, obs);
+    
+    auto forwardCell = [&forward] (size_t i, size_t state) -> double& { return forward(i, state); };
+    auto scale = [&cs] (size_t i) -> double& { return cs[i]; };
+    
+    forward_first_column(model, emissions, forwardCell, scale);
     
-    // Calculate c1
-    for (size_t state = 0; state < model.numStates(); state++)
-        cs[0] += model.startProb(state) * model.emissionProb(state, obs.substr(0,1));
-    // Base case
-    for (size_t state = 0; state < model.numStates(); state++)
-        forward(0, state) = model.startProb(state) * model.emissionProb(state, obs.substr(0,1)) / cs[0];
-
     // Recursion
     for (size_t i = 1; i < obs.length(); i++) {
-        vector<double> delta(model.numStates(), 0);
-        for (size_t state = 0; state < model.numStates(); state++) {
-            if (i < model.stateArity(state))
-                continue;
-            
-            for (auto prevState : model.incommingStates(state)) {
-                double val = forward(i - model.stateArity(state), prevState) * model.transitionProb(prevState, state);
-                for (size_t k = 1; k < model.stateArity(state); k++)
-                    val /= cs[i - k];
-                
-                delta[state] += val;
-            }
-            delta[state] *= model.emissionProb(state, obs.substr(i - model.stateArity(state) + 1, model.stateArity(state)));
-            
-            cs[i] += delta[state];
-        }
-        
-        for (size_t state = 0; state < model.numStates(); state++) {
-            forward(i, state) = delta[state] / cs[i];
-        }
+        emissions.advance();
+        forward_column(model, emissions, i, forwardCell, scale, kernel);
     }
+    if (timings != nullptr)
+        timings->forward = lap();
     
     // Backward algorithm
     Matrix<double> backward(obs.length(), model.numStates(), 0);
@@ -55,25 +157,446 @@ tuple<vector<double>, Matrix<double>, Matrix<double>> forward_backward(string ob
     for (size_t state = 0; state < model.numStates(); state++)
         backward(N, state) = 1;
     
-    for (long i = N - 1; i >= 0; i--) {
-        for (size_t state = 0; state < model.numStates(); state++) {
-            double prob = 0;
+    auto backwardCell = [&backward] (size_t i, size_t state) -> double& { return backward(i, state); };
+    for (long i = N - 1; i >= 0; i--)
+        backward_column(model, emissions, i, N, backwardCell, scale, kernel);
+    if (timings != nullptr)
+        timings->backward = lap();
+    
+    return make_tuple(cs, forward, backward);
+}
+
+tuple<vector<double>, Matrix<double>, Matrix<double>> forward_backward(string obs, const HMM& model)
+{
+    return forward_backward(Sequence(obs), model);
+}
+
+ForwardScorer::ForwardScorer(const HMM& model)
+    : model(model), rows(model.emissionArities().back() + 1), emissions(model),
+      ring(rows, model.numStates(), 0), ringScales(rows, 0), kernel(model), logLik(0)
+{ }
+
+void ForwardScorer::add(const Sequence& chunk)
+{
+    auto forwardCell = [this] (size_t i, size_t state) -> double& { return ring(i % rows, state); };
+    auto scale = [this] (size_t i) -> double& { return ringScales[i % rows]; };
+    
+    for (size_t j = 0; j < chunk.length(); j++) {
+        emissions.push(chunk[j], chunk.isAmbiguous(j));
+        
+        // Once a scale is 0 the columns would only hold NaNs
+        if (logLik == -numeric_limits<double>::infinity())
+            continue;
+        
+        const size_t i = emissions.length() - 1;
+        if (i == 0)
+            forward_first_column(model, emissions, forwardCell, scale);
+        else
+            forward_column(model, emissions, i, forwardCell, scale, kernel);
+        logLik += log(scale(i));
+    }
+}
+
+double forward_loglik(const Sequence& obs, const HMM& model)
+{
+    if (!model.isFinalized())
+        throw runtime_error("Model should be finalized!");
+    if (obs.length() == 0)
+        throw invalid_argument("Empty observation!");
+    
+    ForwardScorer scorer(model);
+    scorer.add(obs);
+    return scorer.logLikelihood();
+}
+
+void forward_loglik(FastaReader& observations, const HMM& model, function<void(const string&, double)> visit)
+{
+    if (!model.isFinalized())
+        throw runtime_error("Model should be finalized!");
+    
+    unique_ptr<ForwardScorer> scorer(new ForwardScorer(model));
+    FastaChunk chunk;
+    while (observations.next(chunk)) {
+        scorer->add(chunk.sequence);
+        if (chunk.endsRecord) {
+            visit(chunk.name, scorer->logLikelihood());
+            scorer.reset(new ForwardScorer(model));
+        }
+    }
+}
+
+/**
+ * Workspace slots of forward_backward_blocks().
+ */
+enum BlockSlot
+{
+    FORWARD_TABLE, BACKWARD_TABLE, SCALES, RING, RING_SCALES,
+    CHECKPOINTS, CHECKPOINT_SCALES, BACKWARD_CHECKPOINTS, BACKWARD_CHECKPOINT_SCALES
+};
+
+ForwardBackwardBlock::ForwardBackwardBlock(size_t length, size_t states, size_t lookback, DPWorkspace& workspace)
+    : first(0), last(0), lookback(lookback),
+      forwardTable(workspace.table<double>(FORWARD_TABLE, lookback + length, states, 0)),
+      backwardTable(workspace.table<double>(BACKWARD_TABLE, length + lookback, states, 0)),
+      scales(workspace.buffer<double>(SCALES, lookback + length + lookback, 0))
+{ }
+
+void forward_backward_blocks(const Sequence& obs, const HMM& model, size_t memoryBudget,
+                             function<void(const ForwardBackwardBlock&)> visit, DPWorkspace* workspace)
+{
+    if (!model.isFinalized())
+        throw runtime_error("Model should be finalized!");
+    if (obs.length() == 0)
+        throw invalid_argument("Empty observation!");
+    
+    const size_t L = obs.length(), N = L - 1, K = model.numStates();
+    const size_t lookback = model.emissionArities().back();
+    
+    // A block keeps lookback forward and backward columns with their scales
+    // as checkpoints, and a position of the block being computed costs a
+    // forward and a backward column and a scale
+    const size_t blockLength = checkpoint_block_length(L, lookback, 2 * lookback * (K + 1) * sizeof(double),
+                                                       (2 * K + 1) * sizeof(double), memoryBudget);
+    const size_t blocks = (L + blockLength - 1) / blockLength;
+    
+    DPWorkspace local;
+    DPWorkspace& tables = workspace != nullptr ? *workspace : local;
+    
+    EmissionStream emissions(model, obs);
+    ForwardKernel kernel(model);
+    
+    // Forward pass keeping the forward columns before every block start,
+    // those of block b at rows (b - 1) * lookback on
+    MatrixView<double> checkpoints;
+    double* checkpointScales = nullptr;
+    if (blocks > 1) {
+        checkpoints = tables.table<double>(CHECKPOINTS, (blocks - 1) * lookback, K, 0);
+        checkpointScales = tables.buffer<double>(CHECKPOINT_SCALES, (blocks - 1) * lookback, 0);
+        
+        const size_t rows = lookback + 1;
+        MatrixView<double> ring = tables.table<double>(RING, rows, K, 0);
+        double* ringScales = tables.buffer<double>(RING_SCALES, rows, 0);
+        auto forwardCell = [&ring, rows] (size_t i, size_t state) -> double& { return ring(i % rows, state); };
+        auto scale = [ringScales, rows] (size_t i) -> double& { return ringScales[i % rows]; };
+        
+        forward_first_column(model, emissions, forwardCell, scale);
+        for (size_t i = 1; i < L; i++) {
+            if (i % blockLength == 0) {
+                const size_t row = (i / blockLength - 1) * lookback;
+                for (size_t r = 0; r < lookback && r < i; r++) {
+                    for (size_t state = 0; state < K; state++)
+                        checkpoints(row + r, state) = forwardCell(i - 1 - r, state);
+                    checkpointScales[row + r] = scale(i - 1 - r);
+                }
+            }
             
-            for (auto nextState : model.outgoingStates(state)) {
-                if (i + model.stateArity(nextState) > N)
-                    continue;
-                
-                double val = backward(i + model.stateArity(nextState), nextState) * model.transitionProb(state, nextState)
-                               * model.emissionProb(nextState, obs.substr(i + 1, model.stateArity(nextState)));
-                
-                for (size_t k = 0; k < model.stateArity(nextState); k++)
-                    val /= cs[i + 1 + k];
-                
-                prob += val;
+            emissions.advance();
+            forward_column(model, emissions, i, forwardCell, scale, kernel);
+        }
+    }
+    
+    // Backward pass keeping the first backward columns of every block, those
+    // of block b at rows b * lookback on, so the blocks can be handed out
+    // from the start of the sequence
+    MatrixView<double> backwardCheckpoints = tables.table<double>(BACKWARD_CHECKPOINTS, blocks * lookback, K, 0);
+    double* backwardCheckpointScales = tables.buffer<double>(BACKWARD_CHECKPOINT_SCALES, blocks * lookback, 0);
+    
+    ForwardBackwardBlock block(blockLength, K, lookback, tables);
+    auto forwardCell = [&block] (size_t i, size_t state) -> double& { return block.forward(i, state); };
+    auto backwardCell = [&block] (size_t i, size_t state) -> double& { return block.backward(i, state); };
+    auto scale = [&block] (size_t i) -> double& { return block.scale(i); };
+    
+    // Fill block b, given the backward columns and scales of the lookback
+    // positions following it at row next of the backward checkpoints
+    auto computeBlock = [&] (size_t b, size_t next) {
+        const size_t begin = b * blockLength, end = min(begin + blockLength, L);
+        block.moveTo(begin, end);
+        
+        if (begin == 0) {
+            emissions.seek(0);
+            forward_first_column(model, emissions, forwardCell, scale);
+        } else {
+            const size_t row = (b - 1) * lookback;
+            for (size_t r = 0; r < lookback && r < begin; r++) {
+                for (size_t state = 0; state < K; state++)
+                    block.forward(begin - 1 - r, state) = checkpoints(row + r, state);
+                block.scale(begin - 1 - r) = checkpointScales[row + r];
             }
-            backward(i, state) = prob;
+            emissions.seek(begin - 1);
+        }
+        for (size_t i = max<size_t>(begin, 1); i < end; i++) {
+            emissions.advance();
+            forward_column(model, emissions, i, forwardCell, scale, kernel);
+        }
+        
+        for (size_t r = 0; r < lookback && end + r < L; r++) {
+            for (size_t state = 0; state < K; state++)
+                block.backward(end + r, state) = backwardCheckpoints(next + r, state);
+            block.scale(end + r) = backwardCheckpointScales[next + r];
+        }
+        
+        for (size_t i = end; i-- > begin;) {
+            if (i == N) {
+                for (size_t state = 0; state < K; state++)
+                    block.backward(N, state) = 1;
+            } else
+                backward_column(model, emissions, i, N, backwardCell, scale, kernel);
+        }
+    };
+    
+    for (size_t b = blocks - 1; b > 0; b--) {
+        computeBlock(b, ((b + 1) % blocks) * lookback);
+        for (size_t r = 0; r < lookback && block.begin() + r < block.end(); r++) {
+            for (size_t state = 0; state < K; state++)
+                backwardCheckpoints(b * lookback + r, state) = block.backward(block.begin() + r, state);
+            backwardCheckpointScales[b * lookback + r] = block.scale(block.begin() + r);
         }
     }
     
-    return make_tuple(cs, forward, backward);
+    // The last block has nothing after it, so it reads the unused entry 0
+    for (size_t b = 0; b < blocks; b++) {
+        computeBlock(b, ((b + 1) % blocks) * lookback);
+        visit(block);
+    }
+}
+
+/**
+ * A transfer matrix of the forward scan whose row u is scaled by
+ * exp(logs[u]), so that its entries stay in range.
+ */
+struct ForwardTransfer
+{
+    Matrix<double> values;
+    vector<double> logs;
+};
+
+/**
+ * Run the unscaled forward recursion over positions [from, to) for every
+ * frontier entry at once. Row r * K + state of carry holds the values of
+ * state in ring row r, one column per entry, with emissions positioned at
+ * from - 1. The column of an entry is divided by the sum of every new
+ * column to keep it in range, and the logs of those factors are added to
+ * logs.
+ */
+static void forward_carry(const HMM& model, EmissionStream& emissions, Matrix<double>& carry, size_t rows,
+                          size_t from, size_t to, vector<double>& logs)
+{
+    const size_t K = model.numStates(), D = carry.columns();
+    vector<double> sums(D), factors(D);
+    
+    for (size_t i = from; i < to; i++) {
+        emissions.advance();
+        fill(sums.begin(), sums.end(), 0.);
+        for (size_t state = 0; state < K; state++) {
+            const size_t prevRow = (i - model.stateArity(state)) % rows;
+            double* out = carry.row((i % rows) * K + state).data();
+            fill(out, out + D, 0.);
+            
+            Span<const size_t> incomming = model.incommingStates(state);
+            Span<const double> probs = model.incommingProbs(state);
+            for (size_t j = 0; j < incomming.size(); j++) {
+                const double* in = carry.row(prevRow * K + incomming[j]).data();
+                const double prob = probs[j];
+                for (size_t u = 0; u < D; u++)
+                    out[u] += in[u] * prob;
+            }
+            
+            const double prob = emissions.prob(state);
+            for (size_t u = 0; u < D; u++) {
+                out[u] *= prob;
+                sums[u] += out[u];
+            }
+        }
+        
+        for (size_t u = 0; u < D; u++) {
+            factors[u] = sums[u] > 0 ? 1 / sums[u] : 1;
+            if (sums[u] > 0)
+                logs[u] += log(sums[u]);
+        }
+        for (size_t r = 0; r < carry.rows(); r++) {
+            double* values = carry.row(r).data();
+            for (size_t u = 0; u < D; u++)
+                values[u] *= factors[u];
+        }
+    }
+}
+
+/**
+ * Product of two transfer matrices of the forward scan. Only the first
+ * left.values.rows() columns of left lead to frontier entries.
+ */
+static ForwardTransfer forward_transfer_product(const ForwardTransfer& left, const ForwardTransfer& right)
+{
+    const size_t D = left.values.rows(), W = right.values.columns();
+    const double NEG_INF = -numeric_limits<double>::infinity();
+    
+    ForwardTransfer res = { Matrix<double>(D, W, 0), vector<double>(D, NEG_INF) };
+    const double maxLog = *max_element(right.logs.begin(), right.logs.end());
+    if (maxLog == NEG_INF)
+        return res;
+    
+    vector<double> factors(D);
+    for (size_t v = 0; v < D; v++)
+        factors[v] = exp(right.logs[v] - maxLog);
+    
+    for (size_t u = 0; u < D; u++) {
+        for (size_t v = 0; v < D; v++) {
+            const double weight = left.values(u, v) * factors[v];
+            if (weight == 0)
+                continue;
+            for (size_t w = 0; w < W; w++)
+                res.values(u, w) += weight * right.values(v, w);
+        }
+        
+        double largest = 0;
+        for (size_t w = 0; w < W; w++)
+            largest = max(largest, res.values(u, w));
+        if (largest == 0)
+            continue;
+        for (size_t w = 0; w < W; w++)
+            res.values(u, w) /= largest;
+        res.logs[u] = left.logs[u] + maxLog + log(largest);
+    }
+    return res;
+}
+
+pair<vector<double>, Matrix<double>> forward_parallel(const Sequence& obs, const HMM& model, ThreadPool& pool)
+{
+    if (!model.isFinalized())
+        throw runtime_error("Model should be finalized!");
+    if (obs.length() == 0)
+        throw invalid_argument("Empty observation!");
+    
+    const size_t L = obs.length(), K = model.numStates();
+    const size_t lookback = model.emissionArities().back();
+    const size_t rows = lookback + 1;
+    
+    Matrix<double> forward(L, K, 0);
+    vector<double> cs(L, 0);
+    
+    const vector<pair<size_t,size_t>> frontier = scan_frontier(model);
+    const size_t D = frontier.size();
+    const vector<size_t> bounds = scan_blocks(L, pool.size());
+    const size_t blocks = bounds.size() - 1;
+    
+    // A frontier holds the unscaled forward values of its entries followed
+    // by the sums of the lookback columns before the block, which give back
+    // the scales. Both are linear in the forward values, so block b maps one
+    // to the other by the matrix transfer[b - 1]. The last block needs none.
+    // Frontiers are only known up to a factor.
+    vector<vector<double>> entries(blocks, vector<double>(D + lookback, 0));
+    vector<ForwardTransfer> transfer(blocks > 1 ? blocks - 2 : 0);
+    
+    auto forwardCell = [&forward] (size_t i, size_t state) -> double& { return forward(i, state); };
+    auto scale = [&cs] (size_t i) -> double& { return cs[i]; };
+    
+    pool.parallelFor(max<size_t>(blocks - 1, 1), [&] (size_t b) {
+        EmissionStream emissions(model, obs);
+        
+        if (b == 0) {
+            ForwardKernel kernel(model);
+            forward_first_column(model, emissions, forwardCell, scale);
+            for (size_t i = 1; i < bounds[1]; i++) {
+                emissions.advance();
+                forward_column(model, emissions, i, forwardCell, scale, kernel);
+            }
+            if (blocks == 1)
+                return;
+            
+            // Undo the scaling of the last columns relative to each other
+            double factor = 1;
+            for (size_t back = 1; back <= lookback; back++) {
+                const size_t j = bounds[1] - back;
+                for (size_t state = 0; state < K; state++)
+                    entries[1][D + back - 1] += forward(j, state) / factor;
+                for (size_t v = 0; v < D; v++) {
+                    if (frontier[v].first == back)
+                        entries[1][v] = forward(j, frontier[v].second) / factor;
+                }
+                factor *= cs[j];
+            }
+            return;
+        }
+        
+        const size_t end = bounds[b + 1];
+        Matrix<double> carry(rows * K, D, 0);
+        for (size_t u = 0; u < D; u++)
+            carry(((bounds[b] - frontier[u].first) % rows) * K + frontier[u].second, u) = 1;
+        
+        vector<double> logs(D, 0);
+        emissions.seek(bounds[b] - 1);
+        forward_carry(model, emissions, carry, rows, bounds[b], end, logs);
+        
+        Matrix<double> values(D, D + lookback, 0);
+        for (size_t u = 0; u < D; u++) {
+            for (size_t v = 0; v < D; v++)
+                values(u, v) = carry(((end - frontier[v].first) % rows) * K + frontier[v].second, u);
+            for (size_t back = 1; back <= lookback; back++) {
+                for (size_t state = 0; state < K; state++)
+                    values(u, D + back - 1) += carry(((end - back) % rows) * K + state, u);
+            }
+        }
+        transfer[b - 1] = ForwardTransfer { move(values), move(logs) };
+    });
+    
+    // After the scan transfer[b - 1] leads from the start of block 1 to the
+    // end of block b
+    scan_inclusive(transfer, pool, forward_transfer_product);
+    pool.parallelFor(transfer.size(), [&] (size_t task) {
+        const size_t b = task + 1;
+        const ForwardTransfer& t = transfer[b - 1];
+        
+        double maxLog = -numeric_limits<double>::infinity();
+        for (size_t u = 0; u < D; u++) {
+            if (entries[1][u] > 0)
+                maxLog = max(maxLog, t.logs[u]);
+        }
+        
+        double largest = 0;
+        for (size_t w = 0; w < D + lookback; w++) {
+            double val = 0;
+            for (size_t u = 0; u < D; u++) {
+                if (entries[1][u] > 0 && t.logs[u] > -numeric_limits<double>::infinity())
+                    val += entries[1][u] * exp(t.logs[u] - maxLog) * t.values(u, w);
+            }
+            entries[b + 1][w] = val;
+            largest = max(largest, val);
+        }
+        
+        if (largest > 0) {
+            for (size_t w = 0; w < D + lookback; w++)
+                entries[b + 1][w] /= largest;
+        }
+    });
+    
+    // Run the scaled recursion of every block again from its frontier,
+    // turned back into the scaled forward columns and scales before it
+    pool.parallelFor(blocks - 1, [&] (size_t task) {
+        const size_t b = task + 1, begin = bounds[b];
+        const vector<double>& entry = entries[b];
+        
+        Matrix<double> before(lookback, K, 0);
+        vector<double> beforeScales(lookback, 0);
+        for (size_t v = 0; v < D; v++)
+            before(frontier[v].first - 1, frontier[v].second) = entry[v] / entry[D + frontier[v].first - 1];
+        for (size_t back = 1; back < lookback; back++)
+            beforeScales[back - 1] = entry[D + back - 1] / entry[D + back];
+        
+        auto blockCell = [&] (size_t i, size_t state) -> double& {
+            return i < begin ? before(begin - 1 - i, state) : forward(i, state);
+        };
+        auto blockScale = [&] (size_t i) -> double& {
+            return i < begin ? beforeScales[begin - 1 - i] : cs[i];
+        };
+        
+        EmissionStream emissions(model, obs);
+        emissions.seek(begin - 1);
+        ForwardKernel kernel(model);
+        for (size_t i = begin; i < bounds[b + 1]; i++) {
+            emissions.advance();
+            forward_column(model, emissions, i, blockCell, blockScale, kernel);
+        }
+    });
+    
+    return make_pair(cs, forward);
 }
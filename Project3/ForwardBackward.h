@@ -3,10 +3,165 @@
 #include <string>
 #include <vector>
 #include <tuple>
+#include <functional>
 
 #include "Matrix.h"
+#include "DPWorkspace.h"
 #include "HMM.h"
+#include "Sequence.h"
+#include "ThreadPool.h"
+#include "EmissionStream.h"
+#include "FastaReader.h"
 
 using namespace std;
 
+/**
+ * Seconds spent in the phases of forward_backward().
+ */
+struct ForwardBackwardTimings
+{
+    double setup = 0, forward = 0, backward = 0;
+};
+
+/**
+ * A model laid out for the forward and backward recursions: the states
+ * grouped by emission arity, with scratch space for a column.
+ */
+struct ForwardKernel
+{
+    explicit ForwardKernel(const HMM& model);
+    
+    const vector<size_t>& arities;
+    vector<vector<size_t>> groups;
+    
+    vector<double> delta, weights;
+};
+
+/**
+ * Scales, scaled forward and scaled backward values of obs. Fills in the
+ * time spent per phase if given timings.
+ */
+tuple<vector<double>,Matrix<double>,Matrix<double>> forward_backward(const Sequence& obs, const HMM& model,
+                                                                     ForwardBackwardTimings* timings = nullptr);
 tuple<vector<double>,Matrix<double>,Matrix<double>> forward_backward(string obs, const HMM& model);
+
+/**
+ * The scales and scaled forward values of forward_backward() for a single
+ * long sequence, computed in blocks on the threads of pool by a sum-product
+ * scan over the block boundaries (see ParallelScan.h). Equal to the serial
+ * values up to rounding. The transfer matrices of the blocks cost about
+ * frontier size times the work of running them, so this pays off on pools
+ * with several times more threads than the frontier has entries. Short
+ * sequences and single thread pools run the serial recursion.
+ */
+pair<vector<double>,Matrix<double>> forward_parallel(const Sequence& obs, const HMM& model, ThreadPool& pool);
+
+/**
+ * Log-likelihood log P(x | model) of a sequence fed in chunks of any
+ * length. Runs the forward recursion of forward_backward() on a ring of
+ * the last maxArity + 1 columns and sums the logs of the scales, so memory
+ * does not grow with the sequence.
+ */
+class ForwardScorer
+{
+public:
+    explicit ForwardScorer(const HMM& model);
+    
+    void add(const Sequence& chunk);
+    
+    /**
+     * Log-likelihood of the symbols added so far, -inf if the model cannot
+     * emit them.
+     */
+    double logLikelihood() const { return logLik; }
+    
+    size_t length() const { return emissions.length(); }
+    
+private:
+    const HMM& model;
+    const size_t rows;
+    
+    RollingEmissions emissions;
+    Matrix<double> ring;
+    vector<double> ringScales;
+    ForwardKernel kernel;
+    double logLik;
+};
+
+/**
+ * Log-likelihood of obs in memory linear in the number of states only.
+ */
+double forward_loglik(const Sequence& obs, const HMM& model);
+
+/**
+ * Log-likelihood of every record of a packing reader, which may hand them
+ * out in chunks. visit(name, logLikelihood) is called once the last chunk
+ * of a record is scored.
+ */
+void forward_loglik(FastaReader& observations, const HMM& model, function<void(const string&, double)> visit);
+
+/**
+ * Scaled forward and backward values for the positions [begin, end) of a
+ * sequence. Forward values and scales are also available for the lookback
+ * positions before begin, which is the largest emission arity of the model.
+ * The tables are borrowed from a workspace.
+ */
+class ForwardBackwardBlock
+{
+public:
+    ForwardBackwardBlock(size_t length, size_t states, size_t lookback, DPWorkspace& workspace);
+    
+    size_t begin() const { return first; }
+    size_t end() const { return last; }
+    
+    inline double forward(size_t i, size_t state) const {
+        return forwardTable(i + lookback - first, state);
+    }
+    
+    inline double& forward(size_t i, size_t state) {
+        return forwardTable(i + lookback - first, state);
+    }
+    
+    inline double backward(size_t i, size_t state) const {
+        return backwardTable(i - first, state);
+    }
+    
+    inline double& backward(size_t i, size_t state) {
+        return backwardTable(i - first, state);
+    }
+    
+    inline double scale(size_t i) const {
+        return scales[i + lookback - first];
+    }
+    
+    inline double& scale(size_t i) {
+        return scales[i + lookback - first];
+    }
+    
+    void moveTo(size_t begin, size_t end) {
+        first = begin;
+        last = end;
+    }
+    
+private:
+    size_t first, last, lookback;
+    
+    // Backward values and scales also cover the lookback positions after
+    // the block, which the backward recursion reads.
+    MatrixView<double> forwardTable, backwardTable;
+    double* scales;
+};
+
+/**
+ * Run forward-backward over obs and hand the tables to visit one block at a
+ * time, in order along the sequence. With a memoryBudget in bytes other than
+ * 0, only the columns at the block boundaries are kept and every block is
+ * recomputed from them, so memory grows with the square root of the length
+ * at the cost of about twice the work. The values are identical to those of
+ * forward_backward().
+ *
+ * The tables are borrowed from workspace if given, so visit must not use
+ * the same workspace.
+ */
+void forward_backward_blocks(const Sequence& obs, const HMM& model, size_t memoryBudget,
+                             function<void(const ForwardBackwardBlock&)> visit, DPWorkspace* workspace = nullptr);
@@ -1 +1,232 @@
+#include <string>
+#include <vector>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <memory>
+
+#include <zlib.h>
+
 #include "HMM.h"
+#include "MappedFile.h"
+
+using namespace std;
+
+/*
+ * A binary model file is a header followed by a payload in native byte
+ * order. Integers are uint64_t and probs doubles, so the payload keeps every
+ * section 8-byte aligned:
+ *
+ *   the arity and label length of every state
+ *   the start probs
+ *   the transitions out of every state in CSR layout: numStates + 1
+ *   offsets, then the target states and the probs of all transitions
+ *   the emissions of every state: 4^arity probs by k-mer code if the state
+ *   gets a dense table, else an entry count and (code, prob) pairs
+ *   the labels, padded to 8 bytes
+ */
+
+static const char MODEL_MAGIC[8] = { 'H', 'M', 'M', 'B', 'I', 'N', '3', '\0' };
+static const uint32_t MODEL_VERSION = 1;
+
+struct ModelHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t crc;
+    uint64_t states, transitions, payloadBytes;
+};
+
+static uint32_t payload_crc(const char* data, size_t size)
+{
+    uLong crc = crc32(0, Z_NULL, 0);
+    for (size_t done = 0; done < size;) {
+        const size_t chunk = min<size_t>(size - done, size_t(1) << 30);
+        crc = crc32(crc, reinterpret_cast<const unsigned char*>(data + done), uInt(chunk));
+        done += chunk;
+    }
+    return uint32_t(crc);
+}
+
+template<class T>
+static void put(string& out, const T& value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+/**
+ * Hands out the sections of a payload in order.
+ */
+class PayloadReader
+{
+public:
+    PayloadReader(const char* data, size_t size) : at(data), end(data + size)
+    { }
+    
+    template<class T>
+    const T* take(size_t count) {
+        if (count > size_t(end - at) / sizeof(T))
+            throw runtime_error("Truncated model file!");
+        const T* values = reinterpret_cast<const T*>(at);
+        at += count * sizeof(T);
+        return values;
+    }
+    
+    size_t remaining() const { return end - at; }
+
+private:
+    const char* at;
+    const char* end;
+};
+
+void HMM::toBinary(ofstream& stream) const
+{
+    if (!finalized)
+        throw runtime_error("Model should be finalized!");
+    
+    const size_t K = numStates();
+    string payload;
+    for (size_t i = 0; i < K; i++) {
+        put<uint64_t>(payload, stateArity(i));
+        put<uint64_t>(payload, stateLabel(i).size());
+    }
+    for (size_t i = 0; i < K; i++)
+        put<double>(payload, startProb(i));
+    
+    uint64_t transitions = 0;
+    for (size_t i = 0; i < K; i++) {
+        put<uint64_t>(payload, transitions);
+        transitions += outgoingStates(i).size();
+    }
+    put<uint64_t>(payload, transitions);
+    for (size_t i = 0; i < K; i++) {
+        for (auto j : outgoingStates(i))
+            put<uint64_t>(payload, j);
+    }
+    for (size_t i = 0; i < K; i++) {
+        for (auto prob : outgoingProbs(i))
+            put<double>(payload, prob);
+    }
+    
+    for (size_t i = 0; i < K; i++) {
+        const EmissionTable& table = emissionTable(i);
+        if (table.isDense()) {
+            for (uint64_t code = 0; code < (uint64_t(1) << (2 * stateArity(i))); code++)
+                put<double>(payload, table.prob(code));
+            continue;
+        }
+        
+        uint64_t count = 0;
+        table.forEach([&count] (uint64_t, double) { count++; });
+        put<uint64_t>(payload, count);
+        table.forEach([&payload] (uint64_t code, double prob) {
+            put<uint64_t>(payload, code);
+            put<double>(payload, prob);
+        });
+    }
+    
+    for (size_t i = 0; i < K; i++)
+        payload += stateLabel(i);
+    payload.resize((payload.size() + 7) / 8 * 8, '\0');
+    
+    ModelHeader header;
+    memcpy(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC));
+    header.version = MODEL_VERSION;
+    header.crc = payload_crc(payload.data(), payload.size());
+    header.states = K;
+    header.transitions = transitions;
+    header.payloadBytes = payload.size();
+    
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(payload.data(), payload.size());
+    if (!stream)
+        throw runtime_error("Could not write model!");
+}
+
+HMM HMM::loadFromBinary(const string& path)
+{
+    MappedFile file(path);
+    
+    ModelHeader header;
+    if (file.size() < sizeof(header))
+        throw runtime_error("Not a binary model file: " + path);
+    memcpy(&header, file.data(), sizeof(header));
+    if (memcmp(header.magic, MODEL_MAGIC, sizeof(MODEL_MAGIC)) != 0)
+        throw runtime_error("Not a binary model file: " + path);
+    if (header.version != MODEL_VERSION)
+        throw runtime_error("Unsupported model file version in " + path);
+    if (header.payloadBytes != file.size() - sizeof(header))
+        throw runtime_error("Truncated model file!");
+    
+    const char* data = file.data() + sizeof(header);
+    if (payload_crc(data, header.payloadBytes) != header.crc)
+        throw runtime_error("Corrupt model file: " + path);
+    
+    // Every state takes at least its shape, which keeps 2 * K from wrapping
+    const size_t K = header.states;
+    if (K > header.payloadBytes / (2 * sizeof(uint64_t)))
+        throw runtime_error("Corrupt model file: " + path);
+    PayloadReader reader(data, header.payloadBytes);
+    const uint64_t* shapes = reader.take<uint64_t>(2 * K);
+    const double* startProbs = reader.take<double>(K);
+    const uint64_t* offsets = reader.take<uint64_t>(K + 1);
+    const uint64_t* targets = reader.take<uint64_t>(header.transitions);
+    const double* probs = reader.take<double>(header.transitions);
+    
+    // The emissions come before the labels, so the states are made once
+    // both have been read
+    vector<shared_ptr<const EmissionTable>> tables;
+    for (size_t i = 0; i < K; i++) {
+        const size_t d = shapes[2 * i];
+        if (d == 0 || d > 31)
+            throw runtime_error("Corrupt model file: " + path);
+        
+        if (d <= EmissionTable::MAX_DENSE_ARITY) {
+            const double* table = reader.take<double>(size_t(1) << (2 * d));
+            tables.push_back(make_shared<EmissionTable>(d, table, vector<pair<uint64_t, double>>()));
+            continue;
+        }
+        
+        const size_t count = *reader.take<uint64_t>(1);
+        if (count > reader.remaining() / (2 * sizeof(uint64_t)))
+            throw runtime_error("Truncated model file!");
+        const uint64_t* pairs = reader.take<uint64_t>(2 * count);
+        vector<pair<uint64_t, double>> entries(count);
+        for (size_t e = 0; e < count; e++) {
+            entries[e].first = pairs[2 * e];
+            memcpy(&entries[e].second, &pairs[2 * e + 1], sizeof(double));
+            if (entries[e].first >> (2 * d) != 0 || (e > 0 && entries[e].first <= entries[e - 1].first))
+                throw runtime_error("Corrupt model file: " + path);
+        }
+        tables.push_back(make_shared<EmissionTable>(d, nullptr, move(entries)));
+    }
+    
+    vector<State> states;
+    size_t labelBytes = 0;
+    for (size_t i = 0; i < K; i++) {
+        const size_t length = shapes[2 * i + 1];
+        states.push_back(State(string(reader.take<char>(length), length), tables[i]));
+        labelBytes += length;
+    }
+    
+    // Only the padding of the labels may follow
+    if (reader.remaining() != (8 - labelBytes % 8) % 8)
+        throw runtime_error("Corrupt model file: " + path);
+    
+    HMM model(states);
+    for (size_t i = 0; i < K; i++) {
+        model.setStartProb(i, startProbs[i]);
+        if (offsets[i] > offsets[i + 1] || offsets[i + 1] > header.transitions)
+            throw runtime_error("Corrupt model file: " + path);
+        for (size_t t = offsets[i]; t < offsets[i + 1]; t++) {
+            if (targets[t] >= K)
+                throw runtime_error("Corrupt model file: " + path);
+            model.setTransitionProb(i, targets[t], probs[t]);
+        }
+    }
+    
+    model.finalize();
+    return model;
+}
@@ -3,13 +3,20 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
 #include <stdexcept>
 #include <unordered_map>
 #include <fstream>
 #include <cmath>
+#include <limits>
 #include <sstream>
+#include <memory>
 
 #include "Matrix.h"
+#include "Span.h"
+#include "SparseTransitions.h"
+#include "Sequence.h"
+#include "EmissionTable.h"
 
 using namespace std;
 
@@ -21,7 +28,15 @@ public:
             emissionProbsVec = vector<double>(pow(4, d), 0);
     }
     
-    string getLabel() const { return label; }
+    /**
+     * A state emitting by table. The probs stay indexed by k-mer code, and
+     * are only copied into the observation map once they are changed.
+     */
+    State(string label, shared_ptr<const EmissionTable> table)
+        : label(label), d(table->emissionArity()), table(table)
+    { }
+    
+    const string& getLabel() const { return label; }
     
     size_t emissionArity() const { return d; }
     
@@ -29,6 +44,7 @@ public:
         if (obs.length() != d)
             throw invalid_argument("Wrong length of observation!");
         
+        unpack();
         if (d < D)
             emissionProbsVec[getIndex(obs)] = prob;
         
@@ -43,6 +59,8 @@ public:
         if (obs.length() != d)
             throw invalid_argument("Wrong length of observation!");
         
+        if (table)
+            return table->prob(Sequence::kmerCode(obs));
         if (d < D)
             return emissionProbsVec[getIndex(obs)];
         
@@ -51,18 +69,57 @@ public:
         return 0;
     }
     
+    /**
+     * Emission prob of an observation given by its k-mer code. Symbols
+     * flagged in the wildcards mask are unknown and are summed out.
+     */
+    double getEmissionProb(uint64_t code, uint64_t wildcards = 0) const {
+        if (table)
+            return table->prob(code, wildcards);
+        if (wildcards != 0) {
+            size_t i = 0;
+            while (((wildcards >> i) & 1) == 0)
+                i++;
+            
+            const uint64_t rest = wildcards & ~(uint64_t(1) << i);
+            const uint64_t cleared = code & ~(uint64_t(3) << (2*i));
+            double prob = 0;
+            for (uint64_t c = 0; c < 4; c++)
+                prob += getEmissionProb(cleared | (c << (2*i)), rest);
+            return prob;
+        }
+        
+        if (d < D)
+            return emissionProbsVec[code];
+        
+        auto it = emissionProbs.find(Sequence::kmerString(code, d));
+        return it != emissionProbs.end() ? it->second : 0;
+    }
+    
     void resetEmissions() {
+        table.reset();
         emissionProbs.clear();
-        if (d < D) {
-            for (int i = 0; i < pow(4, d); i++)
-                emissionProbsVec[i] = 0;
-        }
+        if (d < D)
+            emissionProbsVec.assign(size_t(1) << (2 * d), 0);
     }
     
     unordered_map<string,double> getEmissions() const {
-        return emissionProbs;
+        if (!table)
+            return emissionProbs;
+        
+        unordered_map<string,double> res;
+        table->forEach([this, &res] (uint64_t code, double prob) {
+            res[Sequence::kmerString(code, d)] = prob;
+        });
+        return res;
     }
     
+    /**
+     * The table the state emits by, or nullptr once its probs have been
+     * changed.
+     */
+    const EmissionTable* emissionTable() const { return table.get(); }
+    
 private:
     string label;
     size_t d; // Symbols to emit
@@ -70,6 +127,22 @@ private:
     
     unordered_map<string, double> emissionProbs; // Emission probs for a given observation
     vector<double> emissionProbsVec; // Emission probs stored in a vector
+    shared_ptr<const EmissionTable> table; // Emission probs by k-mer code, until changed
+    
+    /**
+     * Copy the probs of the table into the map and the vector.
+     */
+    void unpack() {
+        if (!table)
+            return;
+        
+        emissionProbs = getEmissions();
+        if (d < D) {
+            emissionProbsVec.assign(size_t(1) << (2 * d), 0);
+            table->forEach([this] (uint64_t code, double prob) { emissionProbsVec[code] = prob; });
+        }
+        table.reset();
+    }
     
     inline unsigned int getIndex(char c) const {
         switch (c) {
@@ -91,15 +164,32 @@ private:
     }
 };
 
+/**
+ * Everything finalize() derives from the parameters of a model: the dense
+ * emission tables, the start and transition probabilities in log space and
+ * the possible transitions. A snapshot is immutable and is dropped again by
+ * unlock().
+ */
+struct ModelSnapshot
+{
+    ModelSnapshot(size_t states) : logA(states, states, 0), logPi(states, 0)
+    { }
+    
+    Matrix<double> logA;
+    vector<double> logPi;
+    SparseTransitions transitions;
+    
+    vector<EmissionTable> emissions;
+    vector<size_t> arities, arityIndex;
+};
+
 class HMM
 {
 public:
     HMM(vector<State> states) : states(states),
                                 A(Matrix<double>(states.size(), states.size(), 0.)),
                                 pi(vector<double>(states.size(), 0.)),
-                                finalized(false),
-                                incomming(states.size(), {}),
-                                outgoing(states.size(), {})
+                                finalized(false)
     {
         for (int i = 0; i < states.size(); i++) {
             if (stateLabels.count(states[i].getLabel()) > 0)
@@ -130,10 +220,57 @@ public:
         return states[state].getEmissionProb(obs);
     }
     
+    /**
+     * The probability of emitting the length symbols of obs starting at pos.
+     */
+    double emissionProb(size_t state, const Sequence& obs, size_t pos, size_t length) const {
+        if (states[state].emissionArity() != length || pos + length > obs.length())
+            return 0;
+        
+        if (finalized)
+            return snapshot->emissions[state].prob(obs.kmer(pos, length), obs.ambiguityMask(pos, length));
+        return states[state].getEmissionProb(obs.kmer(pos, length), obs.ambiguityMask(pos, length));
+    }
+    
     size_t stateArity(size_t state) const {
         return states[state].emissionArity();
     }
     
+    /**
+     * The dense emission table of a state. Only valid while finalized.
+     */
+    const EmissionTable& emissionTable(size_t state) const {
+        return snapshot->emissions[state];
+    }
+    
+    /**
+     * The distinct emission arities used by the states, in increasing order.
+     */
+    const vector<size_t>& emissionArities() const {
+        return snapshot->arities;
+    }
+    
+    /**
+     * Index of the arity of a state into emissionArities().
+     */
+    size_t arityIndex(size_t state) const {
+        return snapshot->arityIndex[state];
+    }
+    
+    /**
+     * Log of the transition probability. Only valid while finalized.
+     */
+    double logTransitionProb(size_t from, size_t to) const {
+        return snapshot->logA(from, to);
+    }
+    
+    /**
+     * Log of the start probability. Only valid while finalized.
+     */
+    double logStartProb(size_t state) const {
+        return snapshot->logPi[state];
+    }
+    
     void setEmissionProb(size_t state, string obs, double prob) {
         if (finalized)
             throw invalid_argument("Model is finalized!");
@@ -168,23 +305,60 @@ public:
         setStartProb(getState(state), prob);
     }
     
-    vector<size_t> incommingStates(size_t state) const {
-        return incomming[state];
+    /**
+     * Finalized copy of a finalized model with other start probs. The
+     * emission tables are copied from the snapshot, not built again.
+     */
+    HMM withStartProbs(const vector<double>& probs) const {
+        if (!finalized)
+            throw runtime_error("Model should be finalized!");
+        if (probs.size() != numStates())
+            throw invalid_argument("Wrong number of start probs!");
+        
+        HMM res(*this);
+        res.pi = probs;
+        res.snapshot = res.takeSnapshot(snapshot->emissions);
+        return res;
+    }
+    
+    /**
+     * States with a possible transition into state, in increasing order, and
+     * the probs and log-probs of those transitions at the same positions.
+     * Empty while the model is not finalized.
+     */
+    Span<const size_t> incommingStates(size_t state) const {
+        return finalized ? snapshot->transitions.incommingStates(state) : Span<const size_t>();
+    }
+    
+    Span<const double> incommingProbs(size_t state) const {
+        return finalized ? snapshot->transitions.incommingProbs(state) : Span<const double>();
+    }
+    
+    Span<const double> incommingLogProbs(size_t state) const {
+        return finalized ? snapshot->transitions.incommingLogProbs(state) : Span<const double>();
+    }
+    
+    /**
+     * States with a possible transition out of state, like incommingStates().
+     */
+    Span<const size_t> outgoingStates(size_t state) const {
+        return finalized ? snapshot->transitions.outgoingStates(state) : Span<const size_t>();
     }
     
-    vector<size_t> outgoingStates(size_t state) const {
-        return outgoing[state];
+    Span<const double> outgoingProbs(size_t state) const {
+        return finalized ? snapshot->transitions.outgoingProbs(state) : Span<const double>();
     }
     
     size_t numStates() const { return states.size(); }
     
-    size_t getState(string label) const {
-        if (stateLabels.count(label) > 0)
-            return stateLabels.at(label);
+    size_t getState(const string& label) const {
+        auto it = stateLabels.find(label);
+        if (it != stateLabels.end())
+            return it->second;
         throw invalid_argument("Undefined label!");
     }
     
-    string stateLabel(size_t state) const {
+    const string& stateLabel(size_t state) const {
         return states[state].getLabel();
     }
     
@@ -192,10 +366,13 @@ public:
         if (finalized)
             throw runtime_error("Model already finalized!");
         
+        vector<EmissionTable> emissions;
         for (size_t i = 0; i < numStates(); i++) {
+            const EmissionTable* table = states[i].emissionTable();
+            emissions.push_back(table != nullptr ? *table : EmissionTable(stateArity(i), states[i].getEmissions()));
+            
             double emissionProb = 0;
-            for (auto emission : states[i].getEmissions())
-                emissionProb += emission.second;
+            emissions[i].forEach([&emissionProb] (uint64_t, double prob) { emissionProb += prob; });
             if (abs(emissionProb - 1) > EPSILON) {
                 stringstream ss;
                 ss << "Emission probs does not sum to 1 in state '" << stateLabel(i) << "'!";
@@ -212,24 +389,14 @@ public:
             }
         }
         
-        for (size_t i = 0; i < numStates(); i++) {
-            for (size_t j = 0; j < numStates(); j++) {
-                if (transitionProb(i, j) > 0) {
-                    incomming[j].push_back(i);
-                    outgoing[i].push_back(j);
-                }
-            }
-        }
+        snapshot = takeSnapshot(move(emissions));
         
         finalized = true;
     }
     
     void unlock() {
         finalized = false;
-        for (size_t i = 0; i < states.size(); i++) {
-            incomming[i].clear();
-            outgoing[i].clear();
-        }
+        snapshot.reset();
     }
     
     void reset() {
@@ -360,13 +527,49 @@ public:
         return model;
     }
     
+    /**
+     * Write the model in the binary format read by loadFromBinary(). Unlike
+     * the DOT export it keeps the start probs, and every prob exactly.
+     */
+    void toBinary(ofstream& stream) const;
+    
+    /**
+     * Load a model written by toBinary(). The file is mapped into memory and
+     * checked against its checksum. The states emit by tables filled
+     * straight from it, by k-mer code, and the model comes back finalized.
+     */
+    static HMM loadFromBinary(const string& path);
+    
 private:
+    shared_ptr<const ModelSnapshot> takeSnapshot(vector<EmissionTable> emissions) const {
+        shared_ptr<ModelSnapshot> res(new ModelSnapshot(numStates()));
+        
+        for (size_t i = 0; i < numStates(); i++) {
+            for (size_t j = 0; j < numStates(); j++)
+                res->logA(i, j) = log(transitionProb(i, j));
+            res->logPi[i] = log(startProb(i));
+        }
+        res->transitions = SparseTransitions(A, false);
+        
+        res->emissions = move(emissions);
+        auto& arities = res->arities;
+        for (size_t i = 0; i < numStates(); i++) {
+            if (find(arities.begin(), arities.end(), stateArity(i)) == arities.end())
+                arities.push_back(stateArity(i));
+        }
+        sort(arities.begin(), arities.end());
+        for (size_t i = 0; i < numStates(); i++)
+            res->arityIndex.push_back(find(arities.begin(), arities.end(), stateArity(i)) - arities.begin());
+        
+        return res;
+    }
+    
     vector<State> states;
     Matrix<double> A;
     vector<double> pi;
     unordered_map<string, size_t> stateLabels;
     
-    vector<vector<size_t>> incomming, outgoing;
+    shared_ptr<const ModelSnapshot> snapshot; // Built by finalize()
     
     bool finalized;
     
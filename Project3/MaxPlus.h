@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstddef>
+
+using namespace std;
+
+/**
+ * Number of doubles the vectors given to max_plus() are padded to.
+ */
+const size_t MAX_PLUS_WIDTH = 4;
+
+inline size_t max_plus_padded(size_t n)
+{
+    return (n + MAX_PLUS_WIDTH - 1) / MAX_PLUS_WIDTH * MAX_PLUS_WIDTH;
+}
+
+/**
+ * Largest scores[j] + weights[j] over j in [0, n), where n is a multiple of
+ * MAX_PLUS_WIDTH and both arrays are 32-byte aligned. The first j reaching
+ * it is stored in argmax, or n if every sum is -inf. Runs on AVX2 or SSE2
+ * when the processor has them.
+ */
+double max_plus(const double* scores, const double* weights, size_t n, size_t& argmax);
+
+/**
+ * Name of the instruction set max_plus() runs on.
+ */
+const char* max_plus_kernel();
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+
+#include "HMM.h"
+#include "ThreadPool.h"
+
+using namespace std;
+
+/*
+ * Helpers for decoding a single sequence with an associative scan. The
+ * sequence is cut into blocks, one per thread. A recursion entering a block
+ * at position begin reads the columns of the lookback positions before it,
+ * so the state carried across a block boundary (the frontier) is the
+ * entries (back, state) at position begin - back that are actually read:
+ * those where state is a predecessor of a state with arity back or more.
+ *
+ * Every block but the first and last is summarised by its transfer matrix
+ * from the frontier at its start to the frontier at its end. It is found in
+ * a single pass over the block that carries a column per frontier entry
+ * through the recursion, so it costs about frontier size times the serial
+ * work of the block, but reads every emission once. The matrices are
+ * combined in the semiring of the recursion by a tree scan, and every block
+ * is run again from its exact frontier.
+ */
+
+const size_t SCAN_MIN_BLOCK = 1024;
+
+/**
+ * The frontier entries (back, state) of a model.
+ */
+inline vector<pair<size_t,size_t>> scan_frontier(const HMM& model)
+{
+    vector<bool> read(model.numStates() * (model.emissionArities().back() + 1), false);
+    for (size_t i = 0; i < model.numStates(); i++) {
+        for (auto k : model.incommingStates(i)) {
+            for (size_t back = 1; back <= model.stateArity(i); back++)
+                read[back * model.numStates() + k] = true;
+        }
+    }
+    
+    vector<pair<size_t,size_t>> frontier;
+    for (size_t back = 1; back <= model.emissionArities().back(); back++) {
+        for (size_t k = 0; k < model.numStates(); k++) {
+            if (read[back * model.numStates() + k])
+                frontier.push_back(make_pair(back, k));
+        }
+    }
+    return frontier;
+}
+
+/**
+ * Split the positions [1, length) into at most parts blocks of at least
+ * SCAN_MIN_BLOCK positions. Block b is [bounds[b], bounds[b+1]).
+ */
+inline vector<size_t> scan_blocks(size_t length, size_t parts)
+{
+    size_t blocks = length > 1 ? min(parts, (length - 1) / SCAN_MIN_BLOCK) : 0;
+    blocks = max<size_t>(blocks, 1);
+    
+    vector<size_t> bounds;
+    for (size_t b = 0; b <= blocks; b++)
+        bounds.push_back(1 + b * (length - 1) / blocks);
+    return bounds;
+}
+
+/**
+ * Inclusive scan of items under an associative combine(left, right), in
+ * about log2 of their number rounds on the threads of pool. Afterwards
+ * items[i] is the combination of the original items 0 to i.
+ */
+template<class T, class Combine>
+void scan_inclusive(vector<T>& items, ThreadPool& pool, Combine combine)
+{
+    for (size_t step = 1; step < items.size(); step *= 2) {
+        vector<T> next(items);
+        pool.parallelFor(items.size() - step, [&] (size_t i) {
+            next[i + step] = combine(items[i], items[i + step]);
+        });
+        items.swap(next);
+    }
+}
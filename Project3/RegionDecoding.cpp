@@ -0,0 +1,116 @@
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <limits>
+#include <tuple>
+
+#include "RegionDecoding.h"
+#include "Viterbi.h"
+#include "ForwardBackward.h"
+
+using namespace std;
+
+HMM interior_model(const HMM& model)
+{
+    if (!model.isFinalized())
+        throw invalid_argument("Model should be finalized!");
+    
+    // Average the state distribution over many transitions, which also
+    // settles for chains that cycle through their states
+    const size_t K = model.numStates(), STEPS = 1000;
+    vector<double> current(K, 1.0 / K), next(K), average(K, 0);
+    for (size_t t = 0; t < STEPS; t++) {
+        fill(next.begin(), next.end(), 0.);
+        for (size_t i = 0; i < K; i++) {
+            for (auto j : model.outgoingStates(i))
+                next[j] += current[i] * model.transitionProb(i, j);
+        }
+        current.swap(next);
+        for (size_t i = 0; i < K; i++)
+            average[i] += current[i] / STEPS;
+    }
+    
+    return model.withStartProbs(average);
+}
+
+/**
+ * The region with flank symbols on either side, cut at the ends of the
+ * sequence, and where it starts.
+ */
+static Sequence fetch_flanked(const IndexedFasta& fasta, const FastaRegion& region, size_t flank, size_t& from)
+{
+    const size_t length = fasta.index().entry(region.name).length;
+    from = region.begin > flank ? region.begin - flank : 0;
+    const size_t to = min(length, region.end + flank);
+    return fasta.fetch(FastaRegion{ region.name, from, to });
+}
+
+pair<double,vector<size_t>> viterbi_region(const IndexedFasta& fasta, const FastaRegion& region, const HMM& model,
+                                           const HMM& interior, size_t flank)
+{
+    if (!model.isFinalized() || !interior.isFinalized())
+        throw invalid_argument("Model should be finalized!");
+    if (region.end > fasta.index().entry(region.name).length)
+        throw invalid_argument("Region outside of " + region.name + "!");
+    if (region.begin >= region.end)
+        return make_pair(-numeric_limits<double>::infinity(), vector<size_t>());
+    
+    size_t from;
+    const Sequence observation = fetch_flanked(fasta, region, flank, from);
+    const auto res = from == 0 ? viterbi(observation, model) : viterbi(observation, interior);
+    if (res.second.empty())
+        return make_pair(res.first, vector<size_t>());
+    
+    // Walk the path back from the last position, as every state ends
+    // where the next one starts
+    const size_t begin = region.begin - from, end = region.end - from;
+    vector<size_t> states(end - begin);
+    size_t last = observation.length();
+    for (size_t j = res.second.size(); j-- > 0 && last > begin;) {
+        const size_t state = res.second[j];
+        const size_t first = last > model.stateArity(state) ? last - model.stateArity(state) : 0;
+        for (size_t pos = max(first, begin); pos < min(last, end); pos++)
+            states[pos - begin] = state;
+        last = first;
+    }
+    
+    return make_pair(res.first, states);
+}
+
+pair<vector<size_t>,vector<double>> posterior_region(const IndexedFasta& fasta, const FastaRegion& region,
+                                                     const HMM& model, const HMM& interior, size_t flank)
+{
+    if (!model.isFinalized() || !interior.isFinalized())
+        throw invalid_argument("Model should be finalized!");
+    if (region.end > fasta.index().entry(region.name).length)
+        throw invalid_argument("Region outside of " + region.name + "!");
+    if (region.begin >= region.end)
+        return make_pair(vector<size_t>(), vector<double>());
+    
+    size_t from;
+    const Sequence observation = fetch_flanked(fasta, region, flank, from);
+    const auto tables = from == 0 ? forward_backward(observation, model)
+                                  : forward_backward(observation, interior);
+    const Matrix<double>& forward = get<1>(tables);
+    const Matrix<double>& backward = get<2>(tables);
+    
+    // The product of the scaled tables is the probability that a state ends
+    // at a position, and a state covers the arity positions up to its end
+    const size_t begin = region.begin - from, end = region.end - from, last = observation.length() - 1;
+    vector<size_t> states(end - begin);
+    vector<double> probs(end - begin, 0);
+    for (size_t pos = begin; pos < end; pos++) {
+        for (size_t k = 0; k < model.numStates(); k++) {
+            double covered = 0;
+            for (size_t p = pos; p < pos + model.stateArity(k) && p <= last; p++)
+                covered += forward(p, k) * backward(p, k);
+            
+            if (covered > probs[pos - begin]) {
+                states[pos - begin] = k;
+                probs[pos - begin] = covered;
+            }
+        }
+    }
+    
+    return make_pair(states, probs);
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <vector>
+#include <utility>
+
+#include "HMM.h"
+#include "FastaIndex.h"
+
+using namespace std;
+
+/*
+ * Decoding a region of a sequence in an indexed FASTA file. The region is
+ * decoded with flank symbols on either side, so the path inside it is not
+ * pulled by the cut, and the result gives the state covering every
+ * position of the region. A region reaching past the end of its sequence
+ * is an invalid_argument.
+ *
+ * A decoded part that starts the sequence uses the start probs of the
+ * model. Anywhere else those do not apply (a gene finder would otherwise
+ * always enter the region in non-coding), so the start probs are how often
+ * the chain enters each state in the long run instead.
+ */
+
+const size_t REGION_FLANK = 2000;
+
+/**
+ * Copy of a finalized model with the start probs replaced by how often the
+ * chain enters each state in the long run. Found by power iteration, so it
+ * is meant to be computed once per model and passed to the functions below.
+ */
+HMM interior_model(const HMM& model);
+
+/**
+ * The Viterbi path of region. Returns the score of the decoded part,
+ * flanks included, and the state covering every position of the region.
+ * interior is interior_model(model).
+ */
+pair<double,vector<size_t>> viterbi_region(const IndexedFasta& fasta, const FastaRegion& region, const HMM& model,
+                                           const HMM& interior, size_t flank = REGION_FLANK);
+
+/**
+ * Posterior decoding of region. Returns the most probable state to cover
+ * every position of the region and the probability that it does.
+ * interior is interior_model(model).
+ */
+pair<vector<size_t>,vector<double>> posterior_region(const IndexedFasta& fasta, const FastaRegion& region,
+                                                     const HMM& model, const HMM& interior,
+                                                     size_t flank = REGION_FLANK);
@@ -0,0 +1,164 @@
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+
+#include "Sequence.h"
+
+using namespace std;
+
+Sequence::Sequence(const string& seq) : Sequence()
+{
+    append(seq.data(), seq.length());
+}
+
+void Sequence::reserve(size_t n)
+{
+    words.reserve((n >> 5) + 2);
+    if (ambiguousCount > 0)
+        ambiguous.reserve((n >> 6) + 2);
+}
+
+/**
+ * Make the ambiguity mask cover n symbols and a spare word.
+ */
+void Sequence::growMask(size_t n)
+{
+    ambiguous.resize(max(ambiguous.size(), (n >> 6) + 2), 0);
+}
+
+void Sequence::push_back(char symbol)
+{
+    int code = symbolCode(symbol);
+    if (code < 0) {
+        growMask(len + 1);
+        ambiguous[len >> 6] |= uint64_t(1) << (len & 63);
+        ambiguousCount++;
+        code = 0;
+    }
+    words[len >> 5] |= uint64_t(code) << (2 * (len & 31));
+    len++;
+    
+    // Keep a spare word after the last symbol
+    if ((len >> 5) + 2 > words.size())
+        words.push_back(0);
+    if (ambiguousCount > 0)
+        growMask(len);
+}
+
+// Code of every byte, or 4 for ambiguous symbols
+static const struct SymbolCodes
+{
+    SymbolCodes() {
+        for (int c = 0; c < 256; c++) {
+            int code = Sequence::symbolCode(char(c));
+            codes[c] = code < 0 ? 4 : code;
+        }
+    }
+    
+    uint8_t codes[256];
+} SYMBOL_CODES;
+
+void Sequence::append(const char* symbols, size_t n)
+{
+    words.resize(max(words.size(), ((len + n) >> 5) + 2), 0);
+    if (ambiguousCount > 0)
+        growMask(len + n);
+    
+    // Pack a word at a time
+    size_t i = 0;
+    while (i < n) {
+        const size_t shift = len & 31;
+        const size_t count = min<size_t>(32 - shift, n - i);
+        
+        uint64_t word = 0, wildcards = 0;
+        for (size_t k = 0; k < count; k++) {
+            const uint64_t code = SYMBOL_CODES.codes[(unsigned char) symbols[i + k]];
+            word |= (code & 3) << (2 * k);
+            wildcards |= (code >> 2) << k;
+        }
+        
+        words[len >> 5] |= word << (2 * shift);
+        if (wildcards != 0) {
+            growMask(len + n - i);
+            ambiguous[len >> 6] |= wildcards << (len & 63);
+            ambiguousCount += __builtin_popcountll(wildcards);
+        }
+        
+        i += count;
+        len += count;
+    }
+}
+
+string Sequence::substr(size_t pos, size_t n) const
+{
+    if (pos > len)
+        throw out_of_range("Position outside sequence!");
+    n = min(n, len - pos);
+    
+    string res(n, ' ');
+    for (size_t i = 0; i < n; i++)
+        res[i] = isAmbiguous(pos + i) ? 'N' : symbol((*this)[pos + i]);
+    return res;
+}
+
+/**
+ * Copy count bits of from, starting at bit first, to the start of to. The
+ * bits after them in the last word copied are cleared.
+ */
+static void copy_bits(const vector<uint64_t>& from, size_t first, size_t count, vector<uint64_t>& to)
+{
+    const size_t shift = first & 63, word = first >> 6;
+    for (size_t w = 0; w < (count + 63) / 64; w++) {
+        to[w] = from[word + w] >> shift;
+        if (shift > 0 && word + w + 1 < from.size())
+            to[w] |= from[word + w + 1] << (64 - shift);
+    }
+    if ((count & 63) != 0)
+        to[count >> 6] &= (uint64_t(1) << (count & 63)) - 1;
+}
+
+Sequence Sequence::subsequence(size_t pos, size_t n) const
+{
+    if (pos > len)
+        throw out_of_range("Position outside sequence!");
+    n = min(n, len - pos);
+    
+    Sequence res;
+    res.len = n;
+    res.words.assign((n >> 5) + 2, 0);
+    copy_bits(words, 2 * pos, 2 * n, res.words);
+    
+    if (ambiguousCount > 0) {
+        res.growMask(n);
+        copy_bits(ambiguous, pos, n, res.ambiguous);
+        for (uint64_t word : res.ambiguous)
+            res.ambiguousCount += __builtin_popcountll(word);
+        if (res.ambiguousCount == 0)
+            res.ambiguous.clear();
+    }
+    return res;
+}
+
+string Sequence::kmerString(uint64_t code, size_t k)
+{
+    string res(k, ' ');
+    for (size_t i = 0; i < k; i++, code >>= 2)
+        res[i] = symbol(code);
+    return res;
+}
+
+uint64_t Sequence::kmerCode(const string& kmer)
+{
+    if (kmer.length() > 32)
+        throw invalid_argument("k-mer too long!");
+    
+    uint64_t code = 0;
+    for (size_t i = 0; i < kmer.length(); i++) {
+        int c = symbolCode(kmer[i]);
+        if (c < 0)
+            throw runtime_error("Invalid symbol!");
+        code |= uint64_t(c) << (2*i);
+    }
+    return code;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+using namespace std;
+
+/**
+ * A nucleotide sequence packed with 2 bits per base. Symbols that are not
+ * one of A, C, G or T (e.g. N) are stored as code 0 and flagged in a side
+ * mask, so they can be told apart from a real 'A'. The mask takes another
+ * bit per base, so it is only allocated once there is such a symbol.
+ *
+ * The code of a k-mer has its first symbol in the least significant bits,
+ * matching the indexing used for the emission tables of a State.
+ */
+class Sequence
+{
+public:
+    Sequence() : len(0), ambiguousCount(0), words(2, 0)
+    { }
+    
+    explicit Sequence(const string& seq);
+    
+    size_t length() const { return len; }
+    
+    void reserve(size_t n);
+    void push_back(char symbol);
+    void append(const char* symbols, size_t n);
+    
+    /**
+     * The 2-bit code of the symbol at position pos.
+     */
+    inline unsigned int operator[](size_t pos) const {
+        return (words[pos >> 5] >> (2 * (pos & 31))) & 3;
+    }
+    
+    /**
+     * The code of the k symbols starting at pos (k <= 32).
+     */
+    inline uint64_t kmer(size_t pos, size_t k) const {
+        const size_t offset = 2 * pos;
+        const size_t shift = offset & 63;
+        uint64_t code = words[offset >> 6] >> shift;
+        if (shift + 2 * k > 64)
+            code |= words[(offset >> 6) + 1] << (64 - shift);
+        return k >= 32 ? code : code & ((uint64_t(1) << (2 * k)) - 1);
+    }
+    
+    inline bool isAmbiguous(size_t pos) const {
+        return ambiguousCount != 0 && ((ambiguous[pos >> 6] >> (pos & 63)) & 1);
+    }
+    
+    /**
+     * Bit i is set if symbol pos + i is ambiguous (k <= 64).
+     */
+    inline uint64_t ambiguityMask(size_t pos, size_t k) const {
+        if (ambiguousCount == 0)
+            return 0;
+        
+        const size_t shift = pos & 63;
+        uint64_t mask = ambiguous[pos >> 6] >> shift;
+        if (shift > 0 && shift + k > 64)
+            mask |= ambiguous[(pos >> 6) + 1] << (64 - shift);
+        return k >= 64 ? mask : mask & ((uint64_t(1) << k) - 1);
+    }
+    
+    size_t ambiguousSymbols() const { return ambiguousCount; }
+    
+    string substr(size_t pos, size_t n) const;
+    
+    /**
+     * The n symbols from pos on, cut at the end, copied still packed.
+     */
+    Sequence subsequence(size_t pos, size_t n) const;
+    string toString() const { return substr(0, len); }
+    
+    /**
+     * Code of a nucleotide, or -1 if the symbol is ambiguous.
+     */
+    static inline int symbolCode(char symbol) {
+        switch (symbol) {
+            case 'A': case 'a': return 0;
+            case 'C': case 'c': return 1;
+            case 'G': case 'g': return 2;
+            case 'T': case 't': return 3;
+            default: return -1;
+        }
+    }
+    
+    static inline char symbol(unsigned int code) {
+        return "ACGT"[code & 3];
+    }
+    
+    /**
+     * Expand a k-mer code back into its string representation.
+     */
+    static string kmerString(uint64_t code, size_t k);
+    
+    /**
+     * The code of a k-mer given as a string of unambiguous symbols.
+     */
+    static uint64_t kmerCode(const string& kmer);
+
+private:
+    void growMask(size_t n);
+    
+    size_t len;
+    size_t ambiguousCount;
+    
+    // One spare word at the end lets kmer() read past the last symbol. The
+    // mask is empty as long as ambiguousCount is 0.
+    vector<uint64_t> words;
+    vector<uint64_t> ambiguous;
+};
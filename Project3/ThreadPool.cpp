@@ -0,0 +1,74 @@
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <algorithm>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+ThreadPool::ThreadPool(size_t threads) : stopping(false)
+{
+    if (threads == 0)
+        threads = max(1u, thread::hardware_concurrency());
+    
+    for (size_t i = 0; i < threads; i++)
+        workers.push_back(thread(&ThreadPool::work, this));
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        unique_lock<mutex> guard(lock);
+        stopping = true;
+    }
+    available.notify_all();
+    
+    for (auto& worker : workers)
+        worker.join();
+}
+
+future<void> ThreadPool::submit(function<void()> task)
+{
+    packaged_task<void()> packaged(task);
+    future<void> result = packaged.get_future();
+    {
+        unique_lock<mutex> guard(lock);
+        tasks.push(move(packaged));
+    }
+    available.notify_one();
+    return result;
+}
+
+void ThreadPool::parallelFor(size_t n, function<void(size_t)> body)
+{
+    vector<future<void>> results;
+    results.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        results.push_back(submit([&body, i] () { body(i); }));
+    
+    // Wait for every task before rethrowing, as they reference body
+    for (auto& result : results)
+        result.wait();
+    for (auto& result : results)
+        result.get();
+}
+
+void ThreadPool::work()
+{
+    while (true) {
+        packaged_task<void()> task;
+        {
+            unique_lock<mutex> guard(lock);
+            available.wait(guard, [this] () { return stopping || !tasks.empty(); });
+            if (tasks.empty())
+                return;
+            
+            task = move(tasks.front());
+            tasks.pop();
+        }
+        task();
+    }
+}
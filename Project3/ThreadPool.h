@@ -0,0 +1,93 @@
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <algorithm>
+
+using namespace std;
+
+/**
+ * A fixed set of worker threads running submitted tasks in FIFO order.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * Start the given number of workers, or one per hardware thread if 0.
+     */
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+    
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    
+    size_t size() const { return workers.size(); }
+    
+    future<void> submit(function<void()> task);
+    
+    /**
+     * Run body(i) for every i in [0, n) on the pool and wait for all of
+     * them. The first exception thrown by a task is rethrown.
+     */
+    void parallelFor(size_t n, function<void(size_t)> body);
+    
+    /**
+     * Pull items with next(item) until it returns false and run body(item)
+     * on the pool for each, with at most window items in flight. Once its
+     * body is done, finish(item) runs on the calling thread, for the items
+     * in the order they were pulled.
+     */
+    template<class Item>
+    void pipeline(function<bool(Item&)> next, function<void(Item&)> body, function<void(Item&)> finish,
+                  size_t window);
+
+private:
+    void work();
+    
+    vector<thread> workers;
+    queue<packaged_task<void()>> tasks;
+    
+    mutex lock;
+    condition_variable available;
+    bool stopping;
+};
+
+template<class Item>
+void ThreadPool::pipeline(function<bool(Item&)> next, function<void(Item&)> body, function<void(Item&)> finish,
+                          size_t window)
+{
+    deque<pair<future<void>, shared_ptr<Item>>> pending;
+    auto finishFront = [&pending, &finish] () {
+        pending.front().first.get();
+        finish(*pending.front().second);
+        pending.pop_front();
+    };
+    
+    try {
+        while (true) {
+            shared_ptr<Item> item = make_shared<Item>();
+            if (!next(*item))
+                break;
+            
+            pending.push_back(make_pair(submit([&body, item] () { body(*item); }), item));
+            if (pending.size() >= max<size_t>(window, 1))
+                finishFront();
+        }
+        while (!pending.empty())
+            finishFront();
+    } catch (...) {
+        // Wait for every task before rethrowing, as they reference body
+        for (auto& task : pending) {
+            if (task.first.valid())
+                task.first.wait();
+        }
+        throw;
+    }
+}
@@ -1,84 +1,411 @@
 #include <vector>
 #include <string>
-#include <cmath>
-#include <unordered_map>
+#include <stdexcept>
+#include <algorithm>
+#include <tuple>
+#include <memory>
 
 #include "Viterbi.h"
-#include "Matrix.h"
+#include "ViterbiEngine.h"
+#include "DPWorkspace.h"
+#include "EmissionStream.h"
+#include "ParallelScan.h"
+#include "RegionDecoding.h"
 
 using namespace std;
 
+pair<double,vector<size_t>> viterbi(const Sequence& observation, const HMM& model, size_t memoryBudget,
+                                    DPWorkspace* workspace)
+{
+    if (!model.isFinalized())
+        throw invalid_argument("Model should be finalized!");
+    
+    EmissionStream emissions(model, observation);
+    return viterbi_decode(model, emissions, observation.length(), memoryBudget, workspace);
+}
+
 pair<double,vector<size_t>> viterbi(string observation, const HMM& model)
+{
+    return viterbi(Sequence(observation), model);
+}
+
+vector<pair<double,vector<size_t>>> viterbi_batch(const vector<Sequence>& observations, const HMM& model,
+                                                  ThreadPool& pool, size_t memoryBudget, bool hugePages)
+{
+    if (!model.isFinalized())
+        throw invalid_argument("Model should be finalized!");
+    
+    // The pool runs tasks in submission order, so the longest sequences
+    // start first and the short ones fill in the gaps at the end
+    vector<size_t> order(observations.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = i;
+    stable_sort(order.begin(), order.end(), [&observations] (size_t a, size_t b) {
+        return observations[a].length() > observations[b].length();
+    });
+    
+    vector<pair<double,vector<size_t>>> results(observations.size());
+    WorkspacePool workspaces(hugePages);
+    pool.parallelFor(order.size(), [&] (size_t i) {
+        unique_ptr<DPWorkspace> workspace = workspaces.borrow();
+        results[order[i]] = viterbi(observations[order[i]], model, memoryBudget, workspace.get());
+        workspaces.giveBack(move(workspace));
+    });
+    
+    return results;
+}
+
+void viterbi_batch(FastaReader& observations, const HMM& model, ThreadPool& pool,
+                   function<void(const FastaChunk&, const pair<double,vector<size_t>>&)> visit, size_t memoryBudget,
+                   bool hugePages)
 {
     if (!model.isFinalized())
         throw invalid_argument("Model should be finalized!");
     
-    // (state, prob)
-    Matrix<pair<int,double>> omega(observation.length(), model.numStates(),
-                                   make_pair(-1, -numeric_limits<double>::infinity()));
+    WorkspacePool workspaces(hugePages);
+    typedef pair<FastaChunk, pair<double,vector<size_t>>> Item;
+    pool.pipeline<Item>([&observations] (Item& item) {
+        return observations.next(item.first);
+    }, [&model, memoryBudget, &workspaces] (Item& item) {
+        unique_ptr<DPWorkspace> workspace = workspaces.borrow();
+        item.second = viterbi(item.first.sequence, model, memoryBudget, workspace.get());
+        workspaces.giveBack(move(workspace));
+    }, [&visit] (Item& item) {
+        visit(item.first, item.second);
+    }, 2 * pool.size());
+}
 
-    unordered_map<double, double> logmemory;
-    auto ln = [&logmemory] (double arg) {
-        if (logmemory.count(arg) > 0)
-            return logmemory.at(arg);
-        
-        double val = log(arg);
-        logmemory.insert(make_pair(arg, val));
-        return val;
-    };
+/**
+ * Run the Viterbi recursion over positions [from, to) for every frontier
+ * entry at once. Row r * K + i of carry holds the scores of state i in ring
+ * row r, one column per entry, with emissions positioned at from - 1.
+ */
+static void viterbi_carry(const HMM& model, EmissionStream& emissions, Matrix<double>& carry, size_t rows,
+                          size_t from, size_t to)
+{
+    const size_t K = model.numStates(), D = carry.columns();
+    const double NEG_INF = -numeric_limits<double>::infinity();
     
-    for (size_t i = 0; i < model.numStates(); i++)
-        omega(0, i) = make_pair(-1, ln(model.startProb(i)) + ln(model.emissionProb(i, observation.substr(0,1))));
-    
-    for (size_t l = 1; l < observation.length(); l++) {
-        for (size_t i = 0; i < model.numStates(); i++) {
-            // Find where we should come from
-            pair<int, double> best = make_pair(-1, -numeric_limits<double>::infinity());
-            for (auto k : model.incommingStates(i)) {
-                if (l < model.stateArity(i))
-                    continue;
-                    
-                double candidate = omega(l - model.stateArity(i) , k).second + ln(model.transitionProb(k, i));
-                if (candidate > best.second)
-                    best = make_pair(k, candidate);
+    for (size_t l = from; l < to; l++) {
+        emissions.advance();
+        for (size_t i = 0; i < K; i++) {
+            const size_t prevRow = (l - model.stateArity(i)) % rows;
+            double* out = carry.row((l % rows) * K + i).data();
+            fill(out, out + D, NEG_INF);
+            
+            Span<const size_t> incomming = model.incommingStates(i);
+            Span<const double> logProbs = model.incommingLogProbs(i);
+            for (size_t j = 0; j < incomming.size(); j++) {
+                const double* in = carry.row(prevRow * K + incomming[j]).data();
+                const double logProb = logProbs[j];
+                for (size_t u = 0; u < D; u++)
+                    out[u] = max(out[u], in[u] + logProb);
             }
             
-            if (best.first == -1) {
-                // State is not possible
-                omega(l, i) = make_pair(-1, -numeric_limits<double>::infinity());
-            } else {
-                // Update current cell with right values
-                omega(l, i) = make_pair(best.first,
-                                        best.second + ln(model.emissionProb(i, observation.substr(l - model.stateArity(i) + 1, model.stateArity(i)))));
+            const double logProb = emissions.logProb(i);
+            for (size_t u = 0; u < D; u++)
+                out[u] += logProb;
+        }
+    }
+}
+
+/**
+ * Max-plus product of two transfer matrices.
+ */
+static Matrix<double> max_plus_product(const Matrix<double>& left, const Matrix<double>& right)
+{
+    Matrix<double> res(left.rows(), right.columns(), -numeric_limits<double>::infinity());
+    for (size_t u = 0; u < left.rows(); u++) {
+        for (size_t v = 0; v < left.columns(); v++) {
+            if (left(u, v) == -numeric_limits<double>::infinity())
+                continue;
+            for (size_t w = 0; w < right.columns(); w++)
+                res(u, w) = max(res(u, w), left(u, v) + right(v, w));
+        }
+    }
+    return res;
+}
+
+template<class Index>
+static pair<double,vector<size_t>> viterbi_scan(const Sequence& observation, const HMM& model, ThreadPool& pool,
+                                                const vector<size_t>& bounds)
+{
+    const size_t L = observation.length(), K = model.numStates();
+    const size_t rows = viterbi_max_arity(model) + 1;
+    const size_t blocks = bounds.size() - 1;
+    const Index NONE = numeric_limits<Index>::max();
+    const double NEG_INF = -numeric_limits<double>::infinity();
+    
+    const vector<pair<size_t,size_t>> frontier = scan_frontier(model);
+    const size_t D = frontier.size();
+    
+    auto loadFrontier = [&] (Matrix<double>& ring, size_t pos, const vector<double>& in) {
+        for (size_t v = 0; v < D; v++)
+            ring((pos - frontier[v].first) % rows, frontier[v].second) = in[v];
+    };
+    
+    const DenseTransitions transitions(model);
+    const DenseTransitions* dense = transitions.enabled() ? &transitions : nullptr;
+    
+    Matrix<Index> backpointers(L, K, NONE);
+    
+    // entries[b] is the frontier at the start of block b, and transfer[b - 1](u, v)
+    // the best score of reaching entry v at the end of block b from entry u
+    // at its start. Block 0 is decoded directly from the start probabilities,
+    // and the last block needs no transfer matrix.
+    vector<vector<double>> entries(blocks, vector<double>(D, NEG_INF));
+    vector<Matrix<double>> transfer(blocks - 2);
+    
+    pool.parallelFor(blocks - 1, [&] (size_t b) {
+        EmissionStream emissions(model, observation);
+        
+        if (b == 0) {
+            Matrix<double> ring(rows, K, NEG_INF);
+            for (size_t i = 0; i < K; i++)
+                ring(0, i) = model.logStartProb(i) + emissions.logProb(i);
+            viterbi_columns(model, emissions, ring, rows, 1, bounds[1], backpointers.view(), 0, dense);
+            for (size_t v = 0; v < D; v++)
+                entries[1][v] = ring((bounds[1] - frontier[v].first) % rows, frontier[v].second);
+            return;
+        }
+        
+        Matrix<double> carry(rows * K, D, NEG_INF);
+        for (size_t u = 0; u < D; u++)
+            carry(((bounds[b] - frontier[u].first) % rows) * K + frontier[u].second, u) = 0;
+        emissions.seek(bounds[b] - 1);
+        viterbi_carry(model, emissions, carry, rows, bounds[b], bounds[b + 1]);
+        
+        transfer[b - 1] = Matrix<double>(D, D, NEG_INF);
+        for (size_t v = 0; v < D; v++) {
+            const size_t row = ((bounds[b + 1] - frontier[v].first) % rows) * K + frontier[v].second;
+            for (size_t u = 0; u < D; u++)
+                transfer[b - 1](u, v) = carry(row, u);
+        }
+    });
+    
+    // After the scan transfer[b - 1] leads from the start of block 1 to the
+    // end of block b
+    scan_inclusive(transfer, pool, max_plus_product);
+    pool.parallelFor(blocks - 2, [&] (size_t task) {
+        const size_t b = task + 1;
+        for (size_t v = 0; v < D; v++) {
+            double best = NEG_INF;
+            for (size_t u = 0; u < D; u++)
+                best = max(best, entries[1][u] + transfer[b - 1](u, v));
+            entries[b + 1][v] = best;
+        }
+    });
+    
+    // Decode every block again from its exact frontier
+    pair<int, double> best = make_pair(-1, NEG_INF);
+    pool.parallelFor(blocks - 1, [&] (size_t task) {
+        const size_t b = task + 1;
+        EmissionStream emissions(model, observation);
+        Matrix<double> ring(rows, K, NEG_INF);
+        
+        loadFrontier(ring, bounds[b], entries[b]);
+        emissions.seek(bounds[b] - 1);
+        viterbi_columns(model, emissions, ring, rows, bounds[b], bounds[b + 1], backpointers.view(), 0, dense);
+        if (b == blocks - 1) {
+            for (size_t i = 0; i < K; i++) {
+                if (ring((L - 1) % rows, i) > best.second)
+                    best = make_pair(i, ring((L - 1) % rows, i));
             }
         }
+    });
+    
+    if (best.first == -1)
+        return make_pair(NEG_INF, vector<size_t>());
+    
+    return make_pair(best.second, viterbi_backtrack<Index>(model, L, best.first,
+                                                           [&backpointers] (size_t pos, size_t state) {
+        return backpointers(pos, state);
+    }));
+}
+
+pair<double,vector<size_t>> viterbi_parallel(const Sequence& observation, const HMM& model, ThreadPool& pool)
+{
+    if (!model.isFinalized())
+        throw invalid_argument("Model should be finalized!");
+    
+    const vector<size_t> bounds = scan_blocks(observation.length(), pool.size());
+    if (bounds.size() < 3)
+        return viterbi(observation, model);
+    
+    size_t maxIncomming = 0;
+    for (size_t i = 0; i < model.numStates(); i++)
+        maxIncomming = max(maxIncomming, model.incommingStates(i).size());
+    
+    if (maxIncomming < numeric_limits<uint8_t>::max())
+        return viterbi_scan<uint8_t>(observation, model, pool, bounds);
+    if (maxIncomming < numeric_limits<uint16_t>::max())
+        return viterbi_scan<uint16_t>(observation, model, pool, bounds);
+    return viterbi_scan<uint32_t>(observation, model, pool, bounds);
+}
+
+/**
+ * Pair every state of a path decoded from length symbols starting at
+ * offset with the position of its last symbol.
+ */
+static vector<pair<size_t,size_t>> path_ends(const HMM& model, const vector<size_t>& path, size_t offset, size_t length)
+{
+    vector<pair<size_t,size_t>> ends(path.size());
+    size_t end = offset + length - 1;
+    for (size_t j = path.size(); j-- > 0;) {
+        ends[j] = make_pair(path[j], end);
+        end -= model.stateArity(path[j]);
     }
+    return ends;
+}
+
+/**
+ * Best path between state from ending at fromEnd and state to ending at
+ * toEnd, without either of them. Returns false if there is none.
+ */
+static bool viterbi_bridge(const HMM& model, const Sequence& observation, size_t from, size_t fromEnd,
+                           size_t to, size_t toEnd, vector<pair<size_t,size_t>>& bridge)
+{
+    const size_t K = model.numStates();
+    const size_t rows = viterbi_max_arity(model) + 1;
+    const uint32_t NONE = numeric_limits<uint32_t>::max();
+    const double NEG_INF = -numeric_limits<double>::infinity();
+    
+    Matrix<double> ring(rows, K, NEG_INF);
+    ring(fromEnd % rows, from) = 0;
+    
+    EmissionStream emissions(model, observation);
+    emissions.seek(fromEnd);
+    Matrix<uint32_t> backpointers(toEnd - fromEnd, K, NONE);
+    viterbi_columns(model, emissions, ring, rows, fromEnd + 1, toEnd + 1, backpointers.view(), fromEnd + 1);
     
-    // Final result is now in prev
-    pair<int, double> best = make_pair(-1, -numeric_limits<double>::infinity());
-    for (int i = 0; i < model.numStates(); i++) {
-        double candidate = omega(observation.length()-1, i).second;
-        if (candidate > best.second)
-            best = make_pair(i, candidate);
+    bridge.clear();
+    if (ring(toEnd % rows, to) == NEG_INF)
+        return false;
+    
+    size_t pos = toEnd, state = to;
+    while (true) {
+        const size_t prev = model.incommingStates(state)[backpointers(pos - fromEnd - 1, state)];
+        pos -= model.stateArity(state);
+        state = prev;
+        if (pos == fromEnd)
+            break;
+        bridge.push_back(make_pair(state, pos));
     }
     
-    if (best.first == -1)
-        return make_pair(-numeric_limits<double>::infinity(), vector<size_t>());
-    
-    // Backtrack
-    vector<size_t> stateTrace;
-    stateTrace.push_back(best.first);
-    size_t pos = observation.length() - 1;
-    auto cur = omega(pos, best.first);
-    size_t prevState = best.first; // TODO: Could probably be refactored
-    while (cur.first != -1) {
-        stateTrace.push_back(cur.first);
+    reverse(bridge.begin(), bridge.end());
+    return true;
+}
 
-        pos -= model.stateArity(prevState);
-        prevState = cur.first;
-        cur = omega(pos, cur.first);
+tuple<double,vector<size_t>,size_t> viterbi_windowed(const Sequence& observation, const HMM& model, ThreadPool& pool,
+                                                     size_t windowLength, size_t overlap)
+{
+    if (!model.isFinalized())
+        throw invalid_argument("Model should be finalized!");
+    if (overlap == 0 || overlap >= windowLength)
+        throw invalid_argument("Overlap should be positive and shorter than the window!");
+    
+    const size_t L = observation.length();
+    const double NEG_INF = -numeric_limits<double>::infinity();
+    
+    if (L <= windowLength) {
+        auto res = viterbi(observation, model);
+        return make_tuple(res.first, res.second, size_t(0));
+    }
+    
+    // Window w covers [w * step, w * step + windowLength), cut at L
+    const size_t step = windowLength - overlap;
+    const size_t windows = 1 + (L - windowLength + step - 1) / step;
+    auto windowEnd = [&] (size_t w) { return min(w * step + windowLength, L); };
+    
+    // Windows after the first do not start where the start probs apply
+    const HMM interior = interior_model(model);
+    
+    vector<vector<pair<size_t,size_t>>> paths(windows);
+    WorkspacePool workspaces;
+    pool.parallelFor(windows, [&] (size_t w) {
+        const size_t start = w * step;
+        unique_ptr<DPWorkspace> workspace = workspaces.borrow();
+        auto res = viterbi(observation.subsequence(start, windowEnd(w) - start), w == 0 ? model : interior, 0,
+                           workspace.get());
+        workspaces.giveBack(move(workspace));
+        paths[w] = path_ends(model, res.second, start, windowEnd(w) - start);
+    });
+    
+    for (auto& path : paths) {
+        if (path.empty())
+            return make_tuple(NEG_INF, vector<size_t>(), size_t(0));
+    }
+    
+    // Join every window to the path so far where both pass through the same
+    // state ending at the same position, as close to the middle of the
+    // overlap as possible. If they never agree, the middle of the overlap is
+    // decoded again between a state of each.
+    vector<pair<size_t,size_t>> merged = paths[0];
+    size_t failed = 0;
+    for (size_t w = 1; w < windows; w++) {
+        const vector<pair<size_t,size_t>>& next = paths[w];
+        const size_t begin = w * step, end = windowEnd(w - 1), mid = begin + (end - begin) / 2;
+        
+        // Index into merged of the state ending at each overlap position
+        vector<size_t> endingAt(end - begin, merged.size());
+        for (size_t j = merged.size(); j-- > 0 && merged[j].second >= begin;)
+            endingAt[merged[j].second - begin] = j;
+        
+        size_t joinMerged = merged.size(), joinNext = next.size(), distance = end - begin;
+        for (size_t j = 0; j < next.size() && next[j].second < end; j++) {
+            const size_t i = endingAt[next[j].second - begin];
+            if (i == merged.size() || merged[i].first != next[j].first)
+                continue;
+            
+            const size_t d = next[j].second > mid ? next[j].second - mid : mid - next[j].second;
+            if (d < distance) {
+                joinMerged = i;
+                joinNext = j;
+                distance = d;
+            }
+        }
+        
+        if (joinNext == next.size()) {
+            failed++;
+            const size_t quarter = (end - begin) / 4;
+            
+            joinMerged = merged.size() - 1;
+            while (merged[joinMerged].second > mid - quarter)
+                joinMerged--;
+            joinNext = 0;
+            while (next[joinNext].second < mid + quarter || next[joinNext].second <= merged[joinMerged].second)
+                joinNext++;
+            
+            // Widen the gap until the model can cross it
+            vector<pair<size_t,size_t>> bridge;
+            while (!viterbi_bridge(model, observation, merged[joinMerged].first, merged[joinMerged].second,
+                                   next[joinNext].first, next[joinNext].second, bridge)) {
+                if (joinMerged == 0 && joinNext + 1 == next.size())
+                    throw runtime_error("Cannot stitch windows!");
+                if (joinMerged > 0)
+                    joinMerged--;
+                if (joinNext + 1 < next.size())
+                    joinNext++;
+            }
+            merged.resize(joinMerged + 1);
+            merged.insert(merged.end(), bridge.begin(), bridge.end());
+            merged.insert(merged.end(), next.begin() + joinNext, next.end());
+        } else {
+            merged.resize(joinMerged + 1);
+            merged.insert(merged.end(), next.begin() + joinNext + 1, next.end());
+        }
+    }
+    
+    // Score the joined path against the whole observation
+    EmissionStream emissions(model, observation);
+    vector<size_t> stateTrace(merged.size());
+    double score = model.logStartProb(merged[0].first) + emissions.logProbAt(merged[0].first, merged[0].second);
+    stateTrace[0] = merged[0].first;
+    for (size_t j = 1; j < merged.size(); j++) {
+        score += model.logTransitionProb(merged[j - 1].first, merged[j].first)
+                   + emissions.logProbAt(merged[j].first, merged[j].second);
+        stateTrace[j] = merged[j].first;
     }
     
-    return make_pair(best.second,
-                     vector<size_t>(stateTrace.rbegin(), stateTrace.rend()));
+    return make_tuple(score, stateTrace, failed);
 }
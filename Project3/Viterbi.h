@@ -2,9 +2,63 @@
 
 #include <vector>
 #include <string>
+#include <tuple>
+#include <functional>
 
 #include "HMM.h"
+#include "Sequence.h"
+#include "ThreadPool.h"
+#include "FastaReader.h"
+#include "DPWorkspace.h"
 
 using namespace std;
 
+/**
+ * Most likely state path for observation. With a memoryBudget in bytes the
+ * backpointer table is checkpointed to fit in it, at the cost of computing
+ * the scores twice. A budget of 0 keeps the full table. The table is
+ * borrowed from workspace if given, so decoding many observations with the
+ * same workspace does not allocate it every time.
+ */
+pair<double,vector<size_t>> viterbi(const Sequence& observation, const HMM& model, size_t memoryBudget = 0,
+                                    DPWorkspace* workspace = nullptr);
 pair<double,vector<size_t>> viterbi(string observation, const HMM& model);
+
+/**
+ * Most likely state path for a single long observation, decoded in blocks
+ * on the threads of pool by a max-plus scan over the block boundaries (see
+ * ParallelScan.h). Equal to viterbi() up to the rounding of the scores at
+ * the boundaries. The transfer matrices of the blocks cost about frontier
+ * size times the work of decoding them, so this pays off on pools with
+ * several times more threads than the frontier has entries. Short
+ * observations and single thread pools are decoded serially.
+ */
+pair<double,vector<size_t>> viterbi_parallel(const Sequence& observation, const HMM& model, ThreadPool& pool);
+
+/**
+ * Decode every observation against the same finalized model on the threads
+ * of pool, starting with the longest. Results are in the order of the input.
+ * Every thread reuses a workspace, backed by huge pages if asked for.
+ */
+vector<pair<double,vector<size_t>>> viterbi_batch(const vector<Sequence>& observations, const HMM& model,
+                                                  ThreadPool& pool, size_t memoryBudget = 0, bool hugePages = false);
+
+/**
+ * Decode every chunk of a packing reader on the threads of pool, handing
+ * the results to visit on the calling thread in the order of the chunks.
+ * Only a few chunks are held in memory at a time.
+ */
+void viterbi_batch(FastaReader& observations, const HMM& model, ThreadPool& pool,
+                   function<void(const FastaChunk&, const pair<double,vector<size_t>>&)> visit,
+                   size_t memoryBudget = 0, bool hugePages = false);
+
+/**
+ * Approximate state path for a very long observation. It is cut into
+ * windows of windowLength symbols overlapping by overlap, which are decoded
+ * independently on the threads of pool and joined where neighbouring paths
+ * pass through the same state at the same position. Returns the score of
+ * the joined path, the path and the number of overlaps where the paths
+ * never agreed; those are decoded again between the two windows.
+ */
+tuple<double,vector<size_t>,size_t> viterbi_windowed(const Sequence& observation, const HMM& model, ThreadPool& pool,
+                                                     size_t windowLength, size_t overlap);
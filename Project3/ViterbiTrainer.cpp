@@ -11,11 +11,13 @@ using namespace std;
 
 void train_by_viterbi(HMM& model, vector<string> observations, unsigned int iterations)
 {
+    vector<Sequence> packed(observations.begin(), observations.end());
+    
     for (unsigned int i = 1; i <= iterations; i++) {
         model.finalize();
         
         vector<vector<string>> annotations;
-        for (string observation : observations) {
+        for (const Sequence& observation : packed) {
             vector<size_t> trace;
             tie(ignore, trace) = viterbi(observation, model);
             
@@ -29,7 +31,7 @@ void train_by_viterbi(HMM& model, vector<string> observations, unsigned int iter
         
         model.unlock();
         
-        train_by_counting(model, observations, annotations);
+        train_by_counting(model, packed, annotations);
         
         cout << "Finished iteration #" << i << " in Viterbi training!" << endl;
     }
@@ -15,6 +15,7 @@
 #include "EMTrainer.h"
 #include "SimpleParser.h"
 #include "ForwardBackward.h"
+#include "ThreadPool.h"
 
 using namespace std;
 
@@ -235,8 +236,10 @@ int main(int argc, const char * argv[])
     
     cout << "Building and traning model..." << endl;
     
+    vector<Sequence> packedObservations(observations.begin(), observations.end());
+    
     HMM model = build_model();
-    train_by_counting(model, observations, parsed);
+    train_by_counting(model, packedObservations, parsed);
     
     cout << "Stop!" << endl;
     
@@ -252,9 +255,10 @@ int main(int argc, const char * argv[])
     
     model.finalize();
     
-    auto toBePredicted = read_seqs_from_files({"genome6.fa","genome7.fa","genome8.fa","genome9.fa","genome10.fa","genome11.fa"});
+    auto toBePredicted = read_packed_seqs_from_files({"genome6.fa","genome7.fa","genome8.fa","genome9.fa","genome10.fa","genome11.fa"});
     
     const int iterations = 20;
+    ThreadPool pool;
     
     /*
     for (int i = 1; i <= iterations; i++) {
@@ -263,28 +267,33 @@ int main(int argc, const char * argv[])
     }
      */
     
-    for (int i = 1; i <= iterations; i++) {
-        model.unlock();
-        
-        cout << "Running iteration " << i << " of viterbi training." << endl;
-        train_by_baumwelch(model, observations);
-        // train_by_viterbi(model, observations, 1);
-    
-        model.finalize();
-    
+    BaumWelchOptions options;
+    options.maxIterations = iterations;
+    options.sideWorkInterval = 5;
+    options.progress = [] (size_t i, double logLikelihood) {
+        cout << "Iteration " << i << " of Baum-Welch training, log-likelihood " << logLikelihood << endl;
+    };
+    options.sideWork = [&toBePredicted, &pool] (size_t i, const HMM& model) {
         cout << "Writing model to dot file..." << endl;
         stringstream modelname;
         modelname << "predictions/model_bwvit_" << i << ".dot";
         ofstream out(modelname.str(), ofstream::out);
         model.toDot(out);
         out.close();
-    
+        
+        stringstream binaryname;
+        binaryname << "predictions/model_bwvit_" << i << ".bin";
+        ofstream binary(binaryname.str(), ofstream::binary);
+        model.toBinary(binary);
+        binary.close();
+        
         cout << "Running Viterbi..." << endl;
+        auto predictions = viterbi_batch(toBePredicted, model, pool);
         for (int j = 0; j < toBePredicted.size(); j++) {
             double probability;
             vector<size_t> trace;
             
-            tie(probability, trace) = viterbi(toBePredicted[j], model);
+            tie(probability, trace) = predictions[j];
             
             cout << "Writing trace..." << endl;
             
@@ -301,8 +310,10 @@ int main(int argc, const char * argv[])
             }
             outpred.close();
         }
-    }
+    };
     
+    model.unlock();
+    train_until_converged(model, packedObservations, pool, options);
     
     /*
     HMM model = test_model();